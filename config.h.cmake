@@ -30,9 +30,15 @@
 
 #cmakedefine DECODER_BACKEND_LIBVPU
 #cmakedefine ENCODER_BACKEND_LIBVPU
+#cmakedefine DECODER_ASYNC
+#cmakedefine DECODER_FRAME_MODE
+#cmakedefine DECODER_INPUT_BUFFERS ${DECODER_INPUT_BUFFERS}
+#cmakedefine DECODER_COMPLETION_THREAD
 
 #cmakedefine HAVE_VA_X11
 #cmakedefine HAVE_VA_EGL
 #cmakedefine HAVE_VA_DRM
+#cmakedefine HAVE_LIBDRM
+#cmakedefine HAVE_V4L2_MOCK
 
 #endif
@@ -657,8 +657,6 @@ H264DecRet H264DecDecode(struct rk_avc_decoder *dec, decContainer_t *pDecCont,
 
 	    H264InitRefPicList(pDecCont);
 
-	    rk_AvcDecoder_getsps(dec);
-	    rk_AvcDecoder_getpps(dec);
 	    rk_AvcDecoder_getDpbInfo(dec);
 	    rk_AvcDecoder_getListInfo(dec);
 	    rk_AvcDecoder_getSliceHeader(dec);
@@ -78,7 +78,6 @@ static const u32 zigZag8x8[64] = {
     4. Local function prototypes
 ------------------------------------------------------------------------------*/
 
-static u32 GetDpbSize(u32 picSizeInMbs, u32 levelIdc);
 static u32 DecodeMvcExtension(strmData_t *pStrmData,
     seqParamSet_t *pSeqParamSet);
 
@@ -483,7 +482,7 @@ u32 h264bsdDecodeSeqParamSet(strmData_t *pStrmData, seqParamSet_t *pSeqParamSet,
 
     /* check that image dimensions and levelIdc match */
     tmp = pSeqParamSet->picWidthInMbs * pSeqParamSet->picHeightInMbs;
-    value = GetDpbSize(tmp, pSeqParamSet->levelIdc);
+    value = h264bsdGetDpbSize(tmp, pSeqParamSet->levelIdc);
     if (value == INVALID_DPB_SIZE || pSeqParamSet->numRefFrames > value)
     {
         DEBUG_PRINT(("WARNING! Invalid DPB size based on SPS Level!\n"));
@@ -562,7 +561,7 @@ u32 h264bsdDecodeSeqParamSet(strmData_t *pStrmData, seqParamSet_t *pSeqParamSet,
 
 /*------------------------------------------------------------------------------
 
-    Function: GetDpbSize
+    Function: h264bsdGetDpbSize
 
         Functional description:
             Get size of the DPB in frames. Size is determined based on the
@@ -585,7 +584,7 @@ u32 h264bsdDecodeSeqParamSet(strmData_t *pStrmData, seqParamSet_t *pSeqParamSet,
 
 ------------------------------------------------------------------------------*/
 
-u32 GetDpbSize(u32 picSizeInMbs, u32 levelIdc)
+u32 h264bsdGetDpbSize(u32 picSizeInMbs, u32 levelIdc)
 {
 
 /* Variables */
@@ -114,4 +114,6 @@ u32 h264bsdDecodeSeqParamSet(strmData_t *pStrmData,
 
 u32 h264bsdCompareSeqParamSets(seqParamSet_t *pSps1, seqParamSet_t *pSps2);
 
+u32 h264bsdGetDpbSize(u32 picSizeInMbs, u32 levelIdc);
+
 #endif /* #ifdef H264HWD_SEQ_PARAM_SET_H */
@@ -109,14 +109,21 @@ static int32_t rk_AvcDecoder_oneframe(struct rk_avc_decoder *dec,
         return dec->status;
     }
 
-    if (rk_AvcDecoder_prepareStream(dec, aInputBuf, aInBufSize)) {
-        printf("prepareStream failed ret %d\n", dec->status);
-        return dec->status;
+    if (dec->stream_in_place) {
+        /* the bus address is only used as an offset */
+        decInput.streamBusAddress   = 0;
+        decInput.pStream            = aInputBuf;
+    } else {
+        if (rk_AvcDecoder_prepareStream(dec, aInputBuf, aInBufSize)) {
+            printf("prepareStream failed ret %d\n", dec->status);
+            return dec->status;
+        }
+
+        decInput.streamBusAddress   = (u32)dec->streamMem->phy_addr;
+        decInput.pStream            = (u8*)dec->streamMem->vir_addr;
     }
 
     decInput.skipNonReference   = 0;
-    decInput.streamBusAddress   = (u32)dec->streamMem->phy_addr;
-    decInput.pStream            = (u8*)dec->streamMem->vir_addr;
     decInput.dataLen            = aInBufSize;
     decInput.picId              = 0;
 
@@ -270,65 +277,6 @@ static void rk_AvcDecoder_reset(struct rk_avc_decoder *dec)
     H264DecReset(dec->H264deccont);
 }
 
-void rk_AvcDecoder_getsps(struct rk_avc_decoder *dec)
-{
-  int i;
-    seqParamSet_t *actSPS = dec->H264deccont->storage.activeSps;
-
-    dec->sps.profile_idc = actSPS->profileIdc;
-    dec->sps.constraint_set_flags = actSPS->constrained_set0_flag;
-    dec->sps.level_idc = actSPS->levelIdc;
-    dec->sps.seq_parameter_set_id = actSPS->seqParameterSetId;
-    dec->sps.chroma_format_idc = actSPS->chromaFormatIdc;
-    dec->sps.bit_depth_luma_minus8 = 0;
-    dec->sps.bit_depth_chroma_minus8 = 0;
-    dec->sps.log2_max_frame_num_minus4 = actSPS->maxFrameNum;
-    dec->sps.pic_order_cnt_type = actSPS->picOrderCntType;
-    dec->sps.log2_max_pic_order_cnt_lsb_minus4 = actSPS->maxPicOrderCntLsb;
-    dec->sps.offset_for_non_ref_pic = actSPS->offsetForNonRefPic;
-    dec->sps.offset_for_top_to_bottom_field = actSPS->offsetForTopToBottomField;
-    dec->sps.num_ref_frames_in_pic_order_cnt_cycle = actSPS->numRefFramesInPicOrderCntCycle;
-    for (i=0; i<sizeof(actSPS->offsetForRefFrame)/sizeof(i32); i++) {
-        dec->sps.offset_for_ref_frame[i] = actSPS->offsetForRefFrame[i];
-    }
-    dec->sps.max_num_ref_frames = actSPS->numRefFrames;
-    dec->sps.pic_width_in_mbs_minus1 = actSPS->picWidthInMbs - 1;
-    dec->sps.pic_height_in_map_units_minus1 = actSPS->picHeightInMbs - 1;
-
-    dec->sps.flags = 0;
-    //dec->sps.flags |= actSPS-> V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE
-    //dec->sps.flags |= actSPS-> V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS
-    dec->sps.flags |= (actSPS->deltaPicOrderAlwaysZeroFlag & 1) << 2;
-    dec->sps.flags |= (actSPS->gapsInFrameNumValueAllowedFlag & 1) << 3;
-    dec->sps.flags |= (actSPS->frameMbsOnlyFlag & 1) << 4;
-    dec->sps.flags |= (actSPS->mbAdaptiveFrameFieldFlag & 1) << 5;
-    dec->sps.flags |= (actSPS->direct8x8InferenceFlag & 1) << 6;
-}
-
-void rk_AvcDecoder_getpps(struct rk_avc_decoder *dec)
-{
-    picParamSet_t *actPPS = dec->H264deccont->storage.activePps;
-
-    dec->pps.pic_parameter_set_id   				= actPPS->picParameterSetId;
-    dec->pps.seq_parameter_set_id 					= actPPS->seqParameterSetId;
-    dec->pps.num_ref_idx_l0_default_active_minus1 	= actPPS->numRefIdxL0Active - 1;
-    dec->pps.num_ref_idx_l1_default_active_minus1 	= actPPS->numRefIdxL1Active - 1;
-    dec->pps.weighted_bipred_idc 					= actPPS->weightedBiPredIdc;
-    dec->pps.pic_init_qp_minus26 					= actPPS->picInitQp - 26;
-    dec->pps.pic_init_qs_minus26 					= 0;
-    dec->pps.chroma_qp_index_offset 				= actPPS->chromaQpIndexOffset;
-    dec->pps.second_chroma_qp_index_offset 			= actPPS->chromaQpIndexOffset2;
-    dec->pps.flags 								= 0;
-    dec->pps.flags 								|= actPPS->entropyCodingModeFlag << 0;
-    dec->pps.flags 								|= actPPS->picOrderPresentFlag << 1;
-    dec->pps.flags 								|= actPPS->weightedPredFlag << 2;
-    dec->pps.flags 								|= actPPS->deblockingFilterControlPresentFlag << 3;
-    dec->pps.flags 								|= actPPS->constrainedIntraPredFlag << 4;
-    dec->pps.flags 								|= actPPS->redundantPicCntPresentFlag << 5;
-    dec->pps.flags 								|= actPPS->transform8x8Flag << 6;
-    dec->pps.flags 								|= actPPS->scalingMatrixPresentFlag << 7;
-}
-
 void rk_AvcDecoder_getSliceHeader(struct rk_avc_decoder *dec)
 {
   sliceHeader_t *slicehdr = &dec->H264deccont->storage.sliceHeader[0];
@@ -37,8 +37,13 @@ struct rk_avc_decoder {
   /* dpb management */
   int dpb_size;
   int dpb_status[32];
+  /* no more than the application has surfaces for, 0 if no limit */
+  int max_dpb_size;
 
-  char header[256];
+  /* sps and pps are the last ones given to the parser */
+  int param_valid;
+  /* the input could be parsed without being copied to streamMem */
+  int stream_in_place;
 
   struct v4l2_ctrl_h264_sps sps;
   struct v4l2_ctrl_h264_pps pps;
@@ -51,8 +56,6 @@ struct rk_avc_decoder {
 
 struct rk_avc_decoder* rk_avc_decoder_alloc_ctx(void);
 void rk_avc_decoder_free_ctx(struct rk_avc_decoder *dec);
-void rk_AvcDecoder_getsps(struct rk_avc_decoder *dec);
-void rk_AvcDecoder_getpps(struct rk_avc_decoder *dec);
 void rk_AvcDecoder_getDpbInfo(struct rk_avc_decoder *dec);
 void rk_AvcDecoder_getListInfo(struct rk_avc_decoder *dec);
 void rk_AvcDecoder_getPoc(struct rk_avc_decoder *dec);
@@ -1,14 +1,16 @@
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
 #include <linux/videodev2.h>
 
 #include "h264d.h"
 #include "common.h"
-#include "h264_stream.h"
 #include "h264d_cabac.h"
+#include "h264d_slice.h"
 #include "h264decapi.h"
 #include "h264hwd_asic.h"
 #include "h264hwd_dpb.h"
+#include "h264hwd_storage.h"
 #include "pv_avcdec_api.h"
 
 #define PIC_IS_ST_TERM(dpb) \
@@ -17,6 +19,13 @@
 #define PIC_IS_LT_TERM(dpb) \
 	(dpb.flags == (V4L2_H264_DPB_ENTRY_FLAG_ACTIVE | V4L2_H264_DPB_ENTRY_FLAG_LONG_TERM))
 
+/* the level given to the parser */
+#define H264D_LEVEL_IDC		40
+
+#define H264_PROFILE_BASELINE	66
+#define H264_PROFILE_MAIN	77
+#define H264_PROFILE_HIGH	100
+
 /* init & return priv ctx */
 void *h264d_init(void)
 {
@@ -42,7 +51,9 @@ bool h264d_prepare_data_raw(void *dec, void *buffer, size_t size,
 	static int frame = 0;
 	int ret = 0; 
 	struct rk_avc_decoder *ctx = (struct rk_avc_decoder*) dec;
+	struct v4l2_ctrl_h264_slice_param slice_param;
 	bool isSpsOrPps = false;
+	bool parsed = false;
 	if (dec == NULL || buffer == NULL) {
 		printf("Invalid input parameters\n");
 		return false;
@@ -58,20 +69,40 @@ bool h264d_prepare_data_raw(void *dec, void *buffer, size_t size,
 		if((data[i]&0x1f)!=1 && (data[i]&0x1f)!=5){
 			isSpsOrPps = true;
 		}
+		/* The parameter sets are from VA, only the header is needed */
+		else if (ctx->param_valid) {
+			parsed = !h264d_parse_slice_header(&ctx->sps, &ctx->pps,
+					data + i, size - i, &slice_param);
+		}
 	}
-	ret = ctx->ops->oneframe(ctx, (uint8_t*)buffer, size);
-	if (ret < 0) {
-		printf("h264d_prepare_data oneframe failed\n");
-		return false;
+	/* The state machine is only needed by the first slice of a
+	 * picture, for the POC and DPB */
+	if (!parsed || 0 == slice_param.first_mb_in_slice) {
+		ret = ctx->ops->oneframe(ctx, (uint8_t*)buffer, size);
+		if (ret < 0) {
+			printf("h264d_prepare_data oneframe failed\n");
+			return false;
+		}
 	}
 	if(isSpsOrPps){
 		return false;
 	}
 
-	memcpy(&ctx->slice_params[ctx->dec_param.num_slices],
+	if (parsed) {
+		if (0 == slice_param.first_mb_in_slice)
+			ctx->dec_param.num_slices = 0;
+		memcpy(&ctx->slice_param, &slice_param, sizeof(slice_param));
+	}
+
+	if (ctx->dec_param.num_slices < sizeof(ctx->slice_params) / sizeof(ctx->slice_params[0])) {
+		memcpy(&ctx->slice_params[ctx->dec_param.num_slices],
 			&ctx->slice_param, sizeof(struct v4l2_ctrl_h264_slice_param));
 
-	ctx->dec_param.num_slices ++;
+		ctx->dec_param.num_slices ++;
+	}
+	else {
+		printf("too many slices in a picture\n");
+	}
 
 	*num_ctrls = H264D_NUM_CTRLS;
 	ctrl_ids[0] = V4L2_CID_MPEG_VIDEO_H264_SPS;
@@ -90,11 +121,52 @@ bool h264d_prepare_data_raw(void *dec, void *buffer, size_t size,
 	payloads[3] = (void*)&ctx->slice_param;
 	payload_sizes[3] = sizeof(ctx->slice_param);
 	payloads[4] = (void*)&ctx->dec_param;
-	payload_sizes[4] = sizeof(ctx->slice_param);
+	payload_sizes[4] = sizeof(ctx->dec_param);
 
 	return true;
 }
 
+/* all the slices of the current picture, for frame based decoding */
+void h264d_get_slice_params(void *dec, void **payload, uint32_t *size)
+{
+	struct rk_avc_decoder *ctx = (struct rk_avc_decoder*) dec;
+
+	*payload = (void*)ctx->slice_params;
+	*size = sizeof(ctx->slice_params[0]) * ctx->dec_param.num_slices;
+}
+
+void h264d_set_max_dpb_size(void *dec, int size)
+{
+	struct rk_avc_decoder *ctx = (struct rk_avc_decoder*) dec;
+
+	ctx->max_dpb_size = size;
+}
+
+int h264d_get_dpb_size(void *dec, int width, int height)
+{
+	struct rk_avc_decoder *ctx = (struct rk_avc_decoder*) dec;
+	u32 dpb_size;
+
+	if (ctx->param_valid)
+		return ctx->dpb_size;
+
+	dpb_size = h264bsdGetDpbSize(((width + 15) / 16) * ((height + 15) / 16),
+			H264D_LEVEL_IDC);
+	if (dpb_size > MAX_NUM_REF_PICS)
+		dpb_size = MAX_NUM_REF_PICS;
+	if (ctx->max_dpb_size && dpb_size > ctx->max_dpb_size)
+		dpb_size = ctx->max_dpb_size;
+
+	return dpb_size;
+}
+
+void h264d_set_stream_in_place(void *dec, bool in_place)
+{
+	struct rk_avc_decoder *ctx = (struct rk_avc_decoder*) dec;
+
+	ctx->stream_in_place = in_place;
+}
+
 /* check input stream */
 static int check_input_stream(struct v4l2_buffer *buffer)
 {
@@ -151,28 +223,236 @@ int h264d_get_unrefed_picture(void *dec)
     return ctx->ops->get_unrefed_picture(dec);
 }
 
+/* VA parameters to the V4L2 SPS, as an encoder would write them */
+static void
+h264d_fill_sps(struct v4l2_ctrl_h264_sps *sps, VAProfile profile,
+int width, int height, VAPictureParameterBufferH264 *pic_param)
+{
+	int frame_mbs_only = pic_param->seq_fields.bits.frame_mbs_only_flag;
+	int mb_width = (width + 15) / 16;
+	int mb_height = (height + 15) / 16;
+
+	if (!frame_mbs_only)
+		mb_height = (mb_height + 1) & ~1;
+
+	memset(sps, 0, sizeof(*sps));
+
+	switch (profile) {
+	case VAProfileH264Baseline:
+	case VAProfileH264ConstrainedBaseline:
+		sps->profile_idc = H264_PROFILE_BASELINE;
+		sps->constraint_set_flags = V4L2_H264_SPS_CONSTRAINT_SET0_FLAG
+			| V4L2_H264_SPS_CONSTRAINT_SET1_FLAG;
+		break;
+	case VAProfileH264Main:
+		sps->profile_idc = H264_PROFILE_MAIN;
+		sps->constraint_set_flags = V4L2_H264_SPS_CONSTRAINT_SET1_FLAG;
+		break;
+	case VAProfileH264High:
+	default:
+		sps->profile_idc = H264_PROFILE_HIGH;
+		break;
+	}
+	/* VA doesn't tell the level, take the one covers 1080p */
+	sps->level_idc = H264D_LEVEL_IDC;
+	sps->seq_parameter_set_id = 0;
+	sps->chroma_format_idc = 1;
+
+	sps->log2_max_frame_num_minus4 =
+		pic_param->seq_fields.bits.log2_max_frame_num_minus4;
+	sps->pic_order_cnt_type = pic_param->seq_fields.bits.pic_order_cnt_type;
+	if (0 == sps->pic_order_cnt_type)
+		sps->log2_max_pic_order_cnt_lsb_minus4 = pic_param->
+			seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4;
+	else if (1 == sps->pic_order_cnt_type
+		&& pic_param->seq_fields.bits.delta_pic_order_always_zero_flag)
+		sps->flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
+
+	sps->max_num_ref_frames = pic_param->num_ref_frames;
+	sps->pic_width_in_mbs_minus1 = mb_width - 1;
+	sps->pic_height_in_map_units_minus1 =
+		(mb_height >> !frame_mbs_only) - 1;
+
+	if (frame_mbs_only)
+		sps->flags |= V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+	else if (pic_param->seq_fields.bits.mb_adaptive_frame_field_flag)
+		sps->flags |= V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD;
+	if (pic_param->seq_fields.bits.direct_8x8_inference_flag)
+		sps->flags |= V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE;
+}
+
+static void
+h264d_fill_pps(struct v4l2_ctrl_h264_pps *pps,
+VAPictureParameterBufferH264 *pic_param,
+VASliceParameterBufferH264 *slice_param)
+{
+	memset(pps, 0, sizeof(*pps));
+
+	pps->pic_parameter_set_id = 0;
+	pps->seq_parameter_set_id = 0;
+	pps->num_slice_groups_minus1 = 0;
+	/* FIXME VA only has the active ones of the slice */
+	pps->num_ref_idx_l0_default_active_minus1 =
+		slice_param->num_ref_idx_l0_active_minus1;
+	pps->num_ref_idx_l1_default_active_minus1 =
+		slice_param->num_ref_idx_l1_active_minus1;
+	pps->weighted_bipred_idc =
+		pic_param->pic_fields.bits.weighted_bipred_idc;
+	pps->pic_init_qp_minus26 = pic_param->pic_init_qp_minus26;
+	pps->pic_init_qs_minus26 = pic_param->pic_init_qs_minus26;
+	pps->chroma_qp_index_offset = pic_param->chroma_qp_index_offset;
+	pps->second_chroma_qp_index_offset =
+		pic_param->second_chroma_qp_index_offset;
+
+	if (pic_param->pic_fields.bits.entropy_coding_mode_flag)
+		pps->flags |= V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE;
+	if (pic_param->pic_fields.bits.pic_order_present_flag)
+		pps->flags |=
+			V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT;
+	if (pic_param->pic_fields.bits.weighted_pred_flag)
+		pps->flags |= V4L2_H264_PPS_FLAG_WEIGHTED_PRED;
+	if (pic_param->pic_fields.bits.deblocking_filter_control_present_flag)
+		pps->flags |= V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT;
+	if (pic_param->pic_fields.bits.constrained_intra_pred_flag)
+		pps->flags |= V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED;
+	if (pic_param->pic_fields.bits.redundant_pic_cnt_present_flag)
+		pps->flags |= V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT;
+	if (pic_param->pic_fields.bits.transform_8x8_mode_flag)
+		pps->flags |= V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE;
+}
+
+/* hand the SPS to the parser, it needs it to parse the slice header */
+static int
+h264d_store_sps(struct rk_avc_decoder *ctx, int width, int height)
+{
+	struct v4l2_ctrl_h264_sps *sps = &ctx->sps;
+	seqParamSet_t *seq;
+	u32 dpb_size;
+
+	seq = (seqParamSet_t *)calloc(1, sizeof(seqParamSet_t));
+	if (NULL == seq)
+		return -1;
+
+	seq->profileIdc = sps->profile_idc;
+	seq->constrained_set0_flag = 
+		!!(sps->constraint_set_flags & V4L2_H264_SPS_CONSTRAINT_SET0_FLAG);
+	seq->constrained_set1_flag = 
+		!!(sps->constraint_set_flags & V4L2_H264_SPS_CONSTRAINT_SET1_FLAG);
+	seq->levelIdc = sps->level_idc;
+	seq->seqParameterSetId = sps->seq_parameter_set_id;
+	seq->chromaFormatIdc = sps->chroma_format_idc;
+	seq->monoChrome = (0 == sps->chroma_format_idc);
+	seq->maxFrameNum = 1 << (sps->log2_max_frame_num_minus4 + 4);
+	seq->picOrderCntType = sps->pic_order_cnt_type;
+	if (0 == seq->picOrderCntType)
+		seq->maxPicOrderCntLsb =
+			1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+	seq->deltaPicOrderAlwaysZeroFlag = !!(sps->flags &
+			V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO);
+	seq->numRefFrames = sps->max_num_ref_frames ? 
+		sps->max_num_ref_frames : 1;
+	seq->gapsInFrameNumValueAllowedFlag = !!(sps->flags &
+			V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED);
+	seq->frameMbsOnlyFlag =
+		!!(sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY);
+	seq->mbAdaptiveFrameFieldFlag =
+		!!(sps->flags & V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD);
+	seq->direct8x8InferenceFlag =
+		!!(sps->flags & V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE);
+	seq->picWidthInMbs = sps->pic_width_in_mbs_minus1 + 1;
+	seq->picHeightInMbs = (sps->pic_height_in_map_units_minus1 + 1)
+		<< !seq->frameMbsOnlyFlag;
+
+	seq->frameCropRightOffset = seq->picWidthInMbs * 16 - width;
+	seq->frameCropBottomOffset = (seq->picHeightInMbs * 16 - height)
+		>> !seq->frameMbsOnlyFlag;
+	seq->frameCroppingFlag = seq->frameCropRightOffset
+		|| seq->frameCropBottomOffset;
+
+	dpb_size = h264bsdGetDpbSize(seq->picWidthInMbs * seq->picHeightInMbs,
+			seq->levelIdc);
+	if (ctx->max_dpb_size && dpb_size > ctx->max_dpb_size)
+		dpb_size = ctx->max_dpb_size;
+	if (dpb_size > MAX_NUM_REF_PICS || seq->numRefFrames > dpb_size)
+		dpb_size = seq->numRefFrames;
+	seq->maxDpbSize = dpb_size;
+	ctx->dpb_size = dpb_size;
+
+	ctx->width = 16 * seq->picWidthInMbs;
+	ctx->height = 16 * seq->picHeightInMbs;
+
+	h264bsdStoreSeqParamSet(&ctx->H264deccont->storage, seq);
+
+	return 0;
+}
+
+static void
+h264d_store_pps(struct rk_avc_decoder *ctx)
+{
+	struct v4l2_ctrl_h264_pps *pps = &ctx->pps;
+	picParamSet_t pic;
+
+	memset(&pic, 0, sizeof(pic));
+
+	pic.picParameterSetId = pps->pic_parameter_set_id;
+	pic.seqParameterSetId = pps->seq_parameter_set_id;
+	pic.numSliceGroups = pps->num_slice_groups_minus1 + 1;
+	pic.numRefIdxL0Active = pps->num_ref_idx_l0_default_active_minus1 + 1;
+	pic.numRefIdxL1Active = pps->num_ref_idx_l1_default_active_minus1 + 1;
+	pic.weightedBiPredIdc = pps->weighted_bipred_idc;
+	pic.picInitQp = pps->pic_init_qp_minus26 + 26;
+	pic.chromaQpIndexOffset = pps->chroma_qp_index_offset;
+	pic.chromaQpIndexOffset2 = pps->second_chroma_qp_index_offset;
+	pic.entropyCodingModeFlag =
+		!!(pps->flags & V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE);
+	pic.picOrderPresentFlag = !!(pps->flags &
+		V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT);
+	pic.weightedPredFlag =
+		!!(pps->flags & V4L2_H264_PPS_FLAG_WEIGHTED_PRED);
+	pic.deblockingFilterControlPresentFlag = !!(pps->flags &
+		V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT);
+	pic.constrainedIntraPredFlag =
+		!!(pps->flags & V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED);
+	pic.redundantPicCntPresentFlag =
+		!!(pps->flags & V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT);
+	pic.transform8x8Flag =
+		!!(pps->flags & V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE);
+
+	h264bsdStorePicParamSet(&ctx->H264deccont->storage, &pic);
+}
+
+/* 
+ * Translate the VA parameters to the SPS/PPS controls, the parser
+ * only sees the parameter sets when they are changed.
+ */
 void 
 h264d_update_param(void *dec, VAProfile profile,
 int width, int height, VAPictureParameterBufferH264 *pic_param,
 VASliceParameterBufferH264 *slice_param)
 {
 	struct rk_avc_decoder *ctx = (struct rk_avc_decoder*) dec;
-	char header[256];
-	int header_len;
+	struct v4l2_ctrl_h264_sps sps;
+	struct v4l2_ctrl_h264_pps pps;
 
-	header_len = write_nal_unit(NAL_UNIT_TYPE_SPS, width, height,
-			profile, pic_param, slice_param, header, 
-			sizeof(header));
-	header_len += write_nal_unit(NAL_UNIT_TYPE_PPS, width, height,
-			profile, pic_param, slice_param, header + header_len,
-			sizeof(header) - header_len);
+	h264d_fill_sps(&sps, profile, width, height, pic_param);
+	h264d_fill_pps(&pps, pic_param, slice_param);
 
-	if (memcmp(ctx->header, header, sizeof(header))) {
-		h264d_prepare_data_raw(ctx, header, header_len,
-				NULL, NULL, NULL, NULL);
+	if (!ctx->param_valid || memcmp(&ctx->sps, &sps, sizeof(sps))) {
+		memcpy(&ctx->sps, &sps, sizeof(sps));
+		if (h264d_store_sps(ctx, width, height) < 0) {
+			ctx->param_valid = false;
+			return;
+		}
+		/* the PPS must be stored again after the SPS */
+		ctx->param_valid = false;
+	}
 
-		memcpy(ctx->header, header, sizeof(header));
+	if (!ctx->param_valid || memcmp(&ctx->pps, &pps, sizeof(pps))) {
+		memcpy(&ctx->pps, &pps, sizeof(pps));
+		h264d_store_pps(ctx);
 	}
+
+	ctx->param_valid = true;
 }
 
 /* delect priv ctx */
@@ -0,0 +1,239 @@
+/*
+ * Run the slice header parser and the state machine on every slice of
+ * an H.264 Annex B stream, and compare the slice params they give.
+ *
+ * usage: h264d_check <stream.h264>
+ * return 0 if all the slices are the same
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "h264d.h"
+#include "h264d_slice.h"
+#include "h264decapi.h"
+#include "h264hwd_storage.h"
+#include "pv_avcdec_api.h"
+
+#define NAL_TYPE_SLICE		1
+#define NAL_TYPE_SLICE_IDR	5
+
+#define FIELD(name) \
+	{ #name, offsetof(struct v4l2_ctrl_h264_slice_param, name), \
+	sizeof(((struct v4l2_ctrl_h264_slice_param *)0)->name) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+	size_t size;
+} fields[] = {
+	FIELD(size),
+	FIELD(header_bit_size),
+	FIELD(first_mb_in_slice),
+	FIELD(slice_type),
+	FIELD(pic_parameter_set_id),
+	FIELD(colour_plane_id),
+	FIELD(frame_num),
+	FIELD(idr_pic_id),
+	FIELD(pic_order_cnt_lsb),
+	FIELD(delta_pic_order_cnt_bottom),
+	FIELD(delta_pic_order_cnt0),
+	FIELD(delta_pic_order_cnt1),
+	FIELD(redundant_pic_cnt),
+	FIELD(pred_weight_table),
+	FIELD(dec_ref_pic_marking_bit_size),
+	FIELD(pic_order_cnt_bit_size),
+	FIELD(cabac_init_idc),
+	FIELD(slice_qp_delta),
+	FIELD(slice_qs_delta),
+	FIELD(disable_deblocking_filter_idc),
+	FIELD(slice_alpha_c0_offset_div2),
+	FIELD(slice_beta_offset_div2),
+	FIELD(slice_group_change_cycle),
+	FIELD(num_ref_idx_l0_active_minus1),
+	FIELD(num_ref_idx_l1_active_minus1),
+	FIELD(ref_pic_list0),
+	FIELD(ref_pic_list1),
+	FIELD(flags),
+};
+
+/*
+ * The state machine has no value for those, the slice header parser
+ * is trusted for them and they are not compared.
+ */
+static void
+take_unchecked_fields(struct v4l2_ctrl_h264_slice_param *expect,
+		const struct v4l2_ctrl_h264_slice_param *result)
+{
+	expect->size = result->size;
+	expect->header_bit_size = result->header_bit_size;
+	memcpy(&expect->pred_weight_table, &result->pred_weight_table,
+			sizeof(expect->pred_weight_table));
+	memcpy(expect->ref_pic_list0, result->ref_pic_list0,
+			sizeof(expect->ref_pic_list0));
+	memcpy(expect->ref_pic_list1, result->ref_pic_list1,
+			sizeof(expect->ref_pic_list1));
+}
+
+/* The fields of the parameter sets the slice header parser reads */
+static void
+fill_params(struct rk_avc_decoder *ctx, struct v4l2_ctrl_h264_sps *sps,
+		struct v4l2_ctrl_h264_pps *pps)
+{
+	storage_t *storage = &ctx->H264deccont->storage;
+	seqParamSet_t *seq = storage->activeSps;
+	picParamSet_t *pic = storage->activePps;
+	uint32_t bits;
+
+	memset(sps, 0, sizeof(*sps));
+	memset(pps, 0, sizeof(*pps));
+
+	sps->chroma_format_idc = seq->chromaFormatIdc;
+	for (bits = 0; (1u << bits) < seq->maxFrameNum; bits++);
+	sps->log2_max_frame_num_minus4 = bits - 4;
+	sps->pic_order_cnt_type = seq->picOrderCntType;
+	if (0 == seq->picOrderCntType) {
+		for (bits = 0; (1u << bits) < seq->maxPicOrderCntLsb; bits++);
+		sps->log2_max_pic_order_cnt_lsb_minus4 = bits - 4;
+	}
+	if (seq->frameMbsOnlyFlag)
+		sps->flags |= V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+	if (seq->deltaPicOrderAlwaysZeroFlag)
+		sps->flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
+
+	pps->num_ref_idx_l0_default_active_minus1 = pic->numRefIdxL0Active - 1;
+	pps->num_ref_idx_l1_default_active_minus1 = pic->numRefIdxL1Active - 1;
+	pps->weighted_bipred_idc = pic->weightedBiPredIdc;
+	if (pic->picOrderPresentFlag)
+		pps->flags |=
+		V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT;
+	if (pic->redundantPicCntPresentFlag)
+		pps->flags |= V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT;
+	if (pic->weightedPredFlag)
+		pps->flags |= V4L2_H264_PPS_FLAG_WEIGHTED_PRED;
+	if (pic->entropyCodingModeFlag)
+		pps->flags |= V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE;
+	if (pic->deblockingFilterControlPresentFlag)
+		pps->flags |=
+		V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT;
+}
+
+static void
+report(uint32_t slice, const struct v4l2_ctrl_h264_slice_param *expect,
+		const struct v4l2_ctrl_h264_slice_param *result)
+{
+	const uint8_t *a = (const uint8_t *)expect;
+	const uint8_t *b = (const uint8_t *)result;
+
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (memcmp(a + fields[i].offset, b + fields[i].offset,
+					fields[i].size))
+			printf("slice %u: %s differs\n", slice, fields[i].name);
+	}
+}
+
+/* The NAL unit starting at the start code at pos, its size with it */
+static size_t
+next_nal(const uint8_t *data, size_t size, size_t pos)
+{
+	size_t end = pos + 3;
+
+	while (end + 3 <= size && !(0 == data[end] && 0 == data[end + 1]
+				&& 1 == data[end + 2]))
+		end++;
+	if (end + 3 > size)
+		return size - pos;
+	/* The zero byte of a 4 bytes start code is the next one's */
+	if (end > pos + 3 && 0 == data[end - 1])
+		end--;
+
+	return end - pos;
+}
+
+int main(int argc, char **argv)
+{
+	struct v4l2_ctrl_h264_slice_param expect, result;
+	struct v4l2_ctrl_h264_sps sps;
+	struct v4l2_ctrl_h264_pps pps;
+	struct rk_avc_decoder *ctx;
+	uint32_t num_slices = 0, num_failed = 0;
+	uint8_t *data;
+	size_t size, pos, len, start;
+	uint32_t type;
+	FILE *fp;
+	long length;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <stream.h264>\n", argv[0]);
+		return 2;
+	}
+
+	fp = fopen(argv[1], "rb");
+	if (NULL == fp || fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0) {
+		perror(argv[1]);
+		return 2;
+	}
+	rewind(fp);
+	size = length;
+	data = malloc(size);
+	if (NULL == data || fread(data, 1, size, fp) != size) {
+		perror(argv[1]);
+		return 2;
+	}
+	fclose(fp);
+
+	ctx = (struct rk_avc_decoder *)h264d_init();
+	if (NULL == ctx)
+		return 2;
+	/* The stream is parsed where it is, as the driver does */
+	h264d_set_stream_in_place(ctx, true);
+
+	for (pos = 0; pos + 3 < size; pos++)
+		if (0 == data[pos] && 0 == data[pos + 1] && 1 == data[pos + 2])
+			break;
+
+	for (; pos + 3 < size; pos += len) {
+		len = next_nal(data, size, pos);
+		start = pos + 3;
+		type = data[start] & 0x1f;
+
+		/* The state machine is given each NAL unit as the driver does */
+		memset(&ctx->slice_param, 0, sizeof(ctx->slice_param));
+		if (ctx->ops->oneframe(ctx, data + pos, len) < 0) {
+			fprintf(stderr, "the state machine fails at %zu\n", pos);
+			num_failed++;
+			continue;
+		}
+		if (NAL_TYPE_SLICE != type && NAL_TYPE_SLICE_IDR != type)
+			continue;
+		if (NULL == ctx->H264deccont->storage.activeSps
+			|| NULL == ctx->H264deccont->storage.activePps)
+			continue;
+
+		num_slices++;
+		memcpy(&expect, &ctx->slice_param, sizeof(expect));
+		fill_params(ctx, &sps, &pps);
+		if (h264d_parse_slice_header(&sps, &pps, data + start,
+					pos + len - start, &result)) {
+			printf("slice %u: the header is not parsed\n",
+					num_slices);
+			num_failed++;
+			continue;
+		}
+
+		take_unchecked_fields(&expect, &result);
+		if (memcmp(&expect, &result, sizeof(expect))) {
+			report(num_slices, &expect, &result);
+			num_failed++;
+		}
+	}
+
+	printf("%u slices, %u differ\n", num_slices, num_failed);
+
+	h264d_deinit(ctx);
+	free(data);
+
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "h264d_slice.h"
+
+#define NAL_TYPE_SLICE_IDR	5
+
+#define SLICE_TYPE_P	0
+#define SLICE_TYPE_B	1
+#define SLICE_TYPE_I	2
+#define SLICE_TYPE_SP	3
+#define SLICE_TYPE_SI	4
+
+/* RBSP reader, the emulation prevention bytes are skipped */
+struct h264d_bitreader {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	uint32_t cur;
+	int bits_left;
+	int zeros;
+	/* bits of the RBSP consumed */
+	uint32_t bits_read;
+	int error;
+};
+
+static void
+br_init(struct h264d_bitreader *br, const uint8_t *data, size_t size)
+{
+	memset(br, 0, sizeof(*br));
+	br->data = data;
+	br->size = size;
+}
+
+static int
+br_next_byte(struct h264d_bitreader *br)
+{
+	uint8_t byte;
+
+	if (br->pos >= br->size) {
+		br->error = 1;
+		return 0;
+	}
+
+	byte = br->data[br->pos++];
+	/* 0x00 0x00 0x03 */
+	if (br->zeros >= 2 && 0x03 == byte) {
+		br->zeros = 0;
+		if (br->pos >= br->size) {
+			br->error = 1;
+			return 0;
+		}
+		byte = br->data[br->pos++];
+	}
+	br->zeros = byte ? 0 : br->zeros + 1;
+
+	return byte;
+}
+
+static uint32_t
+br_read_bits(struct h264d_bitreader *br, int n)
+{
+	uint32_t value = 0;
+
+	while (n--) {
+		if (0 == br->bits_left) {
+			br->cur = br_next_byte(br);
+			br->bits_left = 8;
+		}
+		br->bits_left--;
+		value = (value << 1) | ((br->cur >> br->bits_left) & 1);
+		br->bits_read++;
+	}
+
+	return value;
+}
+
+static uint32_t
+br_read_ue(struct h264d_bitreader *br)
+{
+	int leading_zeros = 0;
+
+	while (!br_read_bits(br, 1)) {
+		if (br->error || ++leading_zeros > 31) {
+			br->error = 1;
+			return 0;
+		}
+	}
+
+	if (!leading_zeros)
+		return 0;
+
+	return (1u << leading_zeros) - 1 + br_read_bits(br, leading_zeros);
+}
+
+static int32_t
+br_read_se(struct h264d_bitreader *br)
+{
+	uint32_t value = br_read_ue(br);
+
+	if (value & 1)
+		return (int32_t)((value + 1) >> 1);
+	return -(int32_t)(value >> 1);
+}
+
+static void
+skip_ref_pic_list_modification(struct h264d_bitreader *br)
+{
+	uint32_t idc;
+
+	/* ref_pic_list_modification_flag */
+	if (!br_read_bits(br, 1))
+		return;
+
+	do {
+		idc = br_read_ue(br);
+		if (idc < 3)
+			/* abs_diff_pic_num_minus1 or long_term_pic_num */
+			br_read_ue(br);
+	} while (3 != idc && !br->error);
+}
+
+/* 
+ * The weight of a reference without an explicit one is 2^denom, which
+ * is 128 at the largest denominator and doesn't fit the __s8 field.
+ * The VPU reads the weights from the slice header itself, so it only
+ * has to be the closest value.
+ */
+static __s8
+default_weight(uint32_t log2_denom)
+{
+	return log2_denom < 7 ? 1 << log2_denom : 127;
+}
+
+static void
+parse_weight_factors(struct h264d_bitreader *br,
+		const struct v4l2_ctrl_h264_sps *sps,
+		struct v4l2_h264_pred_weight_table *table,
+		struct v4l2_h264_weight_factors *factors, int num_refs)
+{
+	for (int i = 0; i < num_refs && i < 32; i++) {
+		factors->luma_weight[i] =
+			default_weight(table->luma_log2_weight_denom);
+		factors->luma_offset[i] = 0;
+		if (br_read_bits(br, 1)) {
+			factors->luma_weight[i] = br_read_se(br);
+			factors->luma_offset[i] = br_read_se(br);
+		}
+
+		if (0 == sps->chroma_format_idc)
+			continue;
+
+		for (int j = 0; j < 2; j++) {
+			factors->chroma_weight[i][j] =
+				default_weight(table->chroma_log2_weight_denom);
+			factors->chroma_offset[i][j] = 0;
+		}
+		if (br_read_bits(br, 1)) {
+			for (int j = 0; j < 2; j++) {
+				factors->chroma_weight[i][j] = br_read_se(br);
+				factors->chroma_offset[i][j] = br_read_se(br);
+			}
+		}
+	}
+}
+
+static void
+skip_dec_ref_pic_marking(struct h264d_bitreader *br, int idr)
+{
+	uint32_t op;
+
+	if (idr) {
+		/* no_output_of_prior_pics_flag, long_term_reference_flag */
+		br_read_bits(br, 2);
+		return;
+	}
+
+	/* adaptive_ref_pic_marking_mode_flag */
+	if (!br_read_bits(br, 1))
+		return;
+
+	do {
+		op = br_read_ue(br);
+		if (1 == op || 3 == op)
+			/* difference_of_pic_nums_minus1 */
+			br_read_ue(br);
+		if (2 == op)
+			/* long_term_pic_num */
+			br_read_ue(br);
+		if (3 == op || 6 == op)
+			/* long_term_frame_idx */
+			br_read_ue(br);
+		if (4 == op)
+			/* max_long_term_frame_idx_plus1 */
+			br_read_ue(br);
+	} while (op && !br->error);
+}
+
+int h264d_parse_slice_header(const struct v4l2_ctrl_h264_sps *sps,
+		const struct v4l2_ctrl_h264_pps *pps,
+		const uint8_t *nal, size_t size,
+		struct v4l2_ctrl_h264_slice_param *slice_param)
+{
+	struct h264d_bitreader br;
+	uint32_t nal_ref_idc, nal_unit_type, slice_type, start;
+	uint32_t num_l0 = 0, num_l1 = 0;
+	int is_p, is_b, is_sp, is_si, field_pic = 0;
+
+	if (size < 2)
+		return -1;
+
+	memset(slice_param, 0, sizeof(*slice_param));
+
+	nal_ref_idc = (nal[0] >> 5) & 0x3;
+	nal_unit_type = nal[0] & 0x1f;
+
+	br_init(&br, nal + 1, size - 1);
+
+	slice_param->size = size;
+	slice_param->first_mb_in_slice = br_read_ue(&br);
+	slice_param->slice_type = br_read_ue(&br);
+	slice_param->pic_parameter_set_id = br_read_ue(&br);
+
+	slice_type = slice_param->slice_type % 5;
+	is_p = (SLICE_TYPE_P == slice_type);
+	is_b = (SLICE_TYPE_B == slice_type);
+	is_sp = (SLICE_TYPE_SP == slice_type);
+	is_si = (SLICE_TYPE_SI == slice_type);
+
+	if (sps->flags & V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE)
+		slice_param->colour_plane_id = br_read_bits(&br, 2);
+
+	slice_param->frame_num =
+		br_read_bits(&br, sps->log2_max_frame_num_minus4 + 4);
+
+	if (!(sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY)) {
+		field_pic = br_read_bits(&br, 1);
+		if (field_pic) {
+			slice_param->flags |= V4L2_SLICE_FLAG_FIELD_PIC;
+			if (br_read_bits(&br, 1))
+				slice_param->flags |=
+					V4L2_SLICE_FLAG_BOTTOM_FIELD;
+		}
+	}
+
+	if (NAL_TYPE_SLICE_IDR == nal_unit_type)
+		slice_param->idr_pic_id = br_read_ue(&br);
+
+	start = br.bits_read;
+	if (0 == sps->pic_order_cnt_type) {
+		slice_param->pic_order_cnt_lsb = br_read_bits(&br,
+				sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+		if ((pps->flags &
+		V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT)
+				&& !field_pic)
+			slice_param->delta_pic_order_cnt_bottom =
+				br_read_se(&br);
+	}
+	if (1 == sps->pic_order_cnt_type && !(sps->flags
+			& V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO)) {
+		slice_param->delta_pic_order_cnt0 = br_read_se(&br);
+		if ((pps->flags &
+		V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT)
+				&& !field_pic)
+			slice_param->delta_pic_order_cnt1 = br_read_se(&br);
+	}
+	slice_param->pic_order_cnt_bit_size = br.bits_read - start;
+
+	if (pps->flags & V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT)
+		slice_param->redundant_pic_cnt = br_read_ue(&br);
+
+	if (is_b && br_read_bits(&br, 1))
+		slice_param->flags |= V4L2_SLICE_FLAG_DIRECT_SPATIAL_MV_PRED;
+
+	if (is_p || is_sp || is_b) {
+		/* num_ref_idx_active_override_flag */
+		if (br_read_bits(&br, 1)) {
+			num_l0 = br_read_ue(&br) + 1;
+			if (is_b)
+				num_l1 = br_read_ue(&br) + 1;
+		}
+		else {
+			num_l0 = pps->num_ref_idx_l0_default_active_minus1 + 1;
+			num_l1 = pps->num_ref_idx_l1_default_active_minus1 + 1;
+		}
+	}
+	slice_param->num_ref_idx_l0_active_minus1 = num_l0 - 1;
+	slice_param->num_ref_idx_l1_active_minus1 = num_l1 - 1;
+
+	if (SLICE_TYPE_I != slice_type && !is_si)
+		skip_ref_pic_list_modification(&br);
+	if (is_b)
+		skip_ref_pic_list_modification(&br);
+
+	if (((pps->flags & V4L2_H264_PPS_FLAG_WEIGHTED_PRED) && (is_p || is_sp))
+		|| (1 == pps->weighted_bipred_idc && is_b)) {
+		struct v4l2_h264_pred_weight_table *table =
+			&slice_param->pred_weight_table;
+
+		table->luma_log2_weight_denom = br_read_ue(&br);
+		if (sps->chroma_format_idc)
+			table->chroma_log2_weight_denom = br_read_ue(&br);
+		parse_weight_factors(&br, sps, table,
+				&table->weight_factors[0], num_l0);
+		if (is_b)
+			parse_weight_factors(&br, sps, table,
+					&table->weight_factors[1], num_l1);
+	}
+
+	if (nal_ref_idc) {
+		start = br.bits_read;
+		skip_dec_ref_pic_marking(&br,
+				NAL_TYPE_SLICE_IDR == nal_unit_type);
+		slice_param->dec_ref_pic_marking_bit_size =
+			br.bits_read - start;
+	}
+
+	if ((pps->flags & V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE)
+			&& SLICE_TYPE_I != slice_type && !is_si)
+		slice_param->cabac_init_idc = br_read_ue(&br);
+
+	slice_param->slice_qp_delta = br_read_se(&br);
+
+	if (is_sp || is_si) {
+		if (is_sp && br_read_bits(&br, 1))
+			slice_param->flags |= V4L2_SLICE_FLAG_SP_FOR_SWITCH;
+		slice_param->slice_qs_delta = br_read_se(&br);
+	}
+
+	if (pps->flags & V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT) {
+		slice_param->disable_deblocking_filter_idc = br_read_ue(&br);
+		if (1 != slice_param->disable_deblocking_filter_idc) {
+			slice_param->slice_alpha_c0_offset_div2 =
+				br_read_se(&br);
+			slice_param->slice_beta_offset_div2 = br_read_se(&br);
+		}
+	}
+
+	/* FIXME slice_group_change_cycle, FMO is not supported */
+
+	/* including the NAL unit header */
+	slice_param->header_bit_size = br.bits_read + 8;
+
+	if (br.error) {
+		printf("slice header is truncated\n");
+		return -1;
+	}
+
+	return 0;
+}
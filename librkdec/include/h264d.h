@@ -15,6 +15,16 @@ bool h264d_prepare_data_raw(void *dec, void *buffer, size_t size,
 		size_t *num_ctrls, uint32_t *ctrl_ids,
 		void **payloads, uint32_t *payload_sizes);
 
+/* zero bytes the parser may read after the end of the input */
+#define H264D_STREAM_PADDING	1024
+
+/* the input of prepare_data_raw is followed by H264D_STREAM_PADDING
+ * zero bytes, it would be parsed without a copy */
+void h264d_set_stream_in_place(void *dec, bool in_place);
+
+/* get the slice params gathered for the current picture */
+void h264d_get_slice_params(void *dec, void **payload, uint32_t *size);
+
 bool h264d_prepare_data(void *dec, struct v4l2_buffer *buffer,
 		size_t *num_ctrls, uint32_t *ctrl_ids,
 		void **payloads, uint32_t *payload_sizes);
@@ -23,6 +33,13 @@ h264d_update_param(void *dec, VAProfile profile,
 int width, int height, VAPictureParameterBufferH264 *pic_param,
 VASliceParameterBufferH264 *slice_param);
 
+/* limit the DPB of the parser, 0 for the level limit */
+void h264d_set_max_dpb_size(void *dec, int size);
+
+/* the number of pictures the parser keeps in its DPB, before any SPS
+ * it is estimated from the picture size */
+int h264d_get_dpb_size(void *dec, int width, int height);
+
 /* a new picture decoded */
 void h264d_picture_ready(void *dec, int index);
 
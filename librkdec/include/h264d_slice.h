@@ -0,0 +1,19 @@
+#ifndef H264D_SLICE_H
+#define H264D_SLICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+/*
+ * Only parse the slice header into the V4L2 slice param, the SPS
+ * and PPS are the ones of the current picture.
+ * The nal starts at the NAL unit header, no start code.
+ * return 0 if success
+ */
+int h264d_parse_slice_header(const struct v4l2_ctrl_h264_sps *sps,
+		const struct v4l2_ctrl_h264_pps *pps,
+		const uint8_t *nal, size_t size,
+		struct v4l2_ctrl_h264_slice_param *slice_param);
+
+#endif
@@ -41,17 +41,9 @@ object_heap_expand(object_heap_p heap)
     int new_heap_size = heap->heap_size + heap->heap_increment;
     int bucket_index = new_heap_size / heap->heap_increment - 1;
 
+    /* The table of buckets is never moved, the lookups don't lock */
     if (bucket_index >= heap->num_buckets) {
-        int new_num_buckets = heap->num_buckets + 8;
-        void **new_bucket;
-
-        new_bucket = realloc(heap->bucket, new_num_buckets * sizeof(void *));
-        if (NULL == new_bucket) {
-            return -1;
-        }
-
-        heap->num_buckets = new_num_buckets;
-        heap->bucket = new_bucket;
+        return -1;
     }
 
     new_heap_index = (void *) malloc(heap->heap_increment * heap->object_size);
@@ -59,7 +51,6 @@ object_heap_expand(object_heap_p heap)
         return -1; /* Out of memory */
     }
 
-    heap->bucket[bucket_index] = new_heap_index;
     next_free = heap->next_free;
     for (i = new_heap_size; i-- > heap->heap_size;) {
         object_base_p obj = (object_base_p)(new_heap_index + (i - heap->heap_size) * heap->object_size);
@@ -68,7 +59,11 @@ object_heap_expand(object_heap_p heap)
         next_free = i;
     }
     heap->next_free = next_free;
-    heap->heap_size = new_heap_size;
+
+    /* A lookup which sees the new size sees the bucket too */
+    __atomic_store_n(&heap->bucket[bucket_index], new_heap_index,
+            __ATOMIC_RELEASE);
+    __atomic_store_n(&heap->heap_size, new_heap_size, __ATOMIC_RELEASE);
     return 0; /* Success */
 }
 
@@ -84,8 +79,11 @@ object_heap_init(object_heap_p heap, int object_size, int id_offset)
     heap->heap_size = 0;
     heap->heap_increment = 16;
     heap->next_free = LAST_FREE;
-    heap->num_buckets = 0;
-    heap->bucket = NULL;
+    heap->num_buckets = (OBJECT_HEAP_ID_MASK + 1) / heap->heap_increment;
+    heap->bucket = calloc(heap->num_buckets, sizeof(void *));
+    if (NULL == heap->bucket) {
+        return -1;
+    }
     return object_heap_expand(heap);
 }
 
@@ -111,7 +109,7 @@ object_heap_allocate_unlocked(object_heap_p heap)
 
     obj = (object_base_p)(heap->bucket[bucket_index] + obj_index * heap->object_size);
     heap->next_free = obj->next_free;
-    obj->next_free = ALLOCATED;
+    __atomic_store_n(&obj->next_free, ALLOCATED, __ATOMIC_RELEASE);
     return obj->id;
 }
 
@@ -127,38 +125,34 @@ object_heap_allocate(object_heap_p heap)
 }
 
 /*
- * Lookup an object by object ID
+ * Lookup an object by object ID, without locking
  * Returns a pointer to the object on success, returns NULL on error
  */
-static object_base_p
-object_heap_lookup_unlocked(object_heap_p heap, int id)
+object_base_p
+object_heap_lookup(object_heap_p heap, int id)
 {
     object_base_p obj;
-    int bucket_index, obj_index;
+    void *bucket;
+    int index;
 
-    if ((id < heap->id_offset) || (id > (heap->heap_size + heap->id_offset))) {
+    if ((id & OBJECT_HEAP_OFFSET_MASK) != heap->id_offset) {
         return NULL;
     }
-    id &= OBJECT_HEAP_ID_MASK;
-    bucket_index = id / heap->heap_increment;
-    obj_index = id % heap->heap_increment;
-    obj = (object_base_p)(heap->bucket[bucket_index] + obj_index * heap->object_size);
-
-    /* Check if the object has in fact been allocated */
-    if (obj->next_free != ALLOCATED) {
+    index = id & OBJECT_HEAP_ID_MASK;
+    if (index >= __atomic_load_n(&heap->heap_size, __ATOMIC_ACQUIRE)) {
         return NULL;
     }
-    return obj;
-}
+    bucket = __atomic_load_n(&heap->bucket[index / heap->heap_increment],
+            __ATOMIC_ACQUIRE);
+    obj = (object_base_p)(bucket + (index % heap->heap_increment) * heap->object_size);
 
-object_base_p
-object_heap_lookup(object_heap_p heap, int id)
-{
-    object_base_p obj;
-
-    pthread_mutex_lock(&heap->mutex);
-    obj = object_heap_lookup_unlocked(heap, id);
-    pthread_mutex_unlock(&heap->mutex);
+    /* Check if the object has in fact been allocated, and not reused */
+    if (__atomic_load_n(&obj->next_free, __ATOMIC_ACQUIRE) != ALLOCATED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&obj->id, __ATOMIC_RELAXED) != id) {
+        return NULL;
+    }
     return obj;
 }
 
@@ -216,11 +210,18 @@ object_heap_next(object_heap_p heap, object_heap_iterator *iter)
 static void
 object_heap_free_unlocked(object_heap_p heap, object_base_p obj)
 {
+    int index = obj->id & OBJECT_HEAP_ID_MASK;
+    int gen;
+
     /* Check if the object has in fact been allocated */
     ASSERT(obj->next_free == ALLOCATED);
 
-    obj->next_free = heap->next_free;
-    heap->next_free = obj->id & OBJECT_HEAP_ID_MASK;
+    /* It gets another ID when it is allocated again */
+    gen = (obj->id + (1 << OBJECT_HEAP_GEN_SHIFT)) & OBJECT_HEAP_GEN_MASK;
+    __atomic_store_n(&obj->id, heap->id_offset | gen | index,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&obj->next_free, heap->next_free, __ATOMIC_RELEASE);
+    heap->next_free = index;
 }
 
 void
@@ -259,6 +260,7 @@ object_heap_destroy(object_heap_p heap)
 
     free(heap->bucket);
     heap->bucket = NULL;
+    heap->num_buckets = 0;
     heap->heap_size = 0;
     heap->next_free = LAST_FREE;
 }
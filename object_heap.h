@@ -27,8 +27,15 @@
 
 #include <pthread.h>
 
+/*
+ * An ID is made of the offset of the heap, a generation bumped each time
+ * the object is freed and the index of the object, so a stale ID is not
+ * found once the object is reused.
+ */
 #define OBJECT_HEAP_OFFSET_MASK 0x7F000000
-#define OBJECT_HEAP_ID_MASK     0x00FFFFFF
+#define OBJECT_HEAP_GEN_MASK    0x00FF0000
+#define OBJECT_HEAP_GEN_SHIFT   16
+#define OBJECT_HEAP_ID_MASK     0x0000FFFF
 
 typedef struct object_base *object_base_p;
 typedef struct object_heap *object_heap_p;
@@ -38,6 +45,10 @@ struct object_base {
     int next_free;
 };
 
+/*
+ * The mutex is only taken to allocate, free and iterate, the lookups
+ * read the buckets published with atomics.
+ */
 struct object_heap {
     pthread_mutex_t mutex;
     int object_size;
@@ -65,7 +76,7 @@ int
 object_heap_allocate(object_heap_p heap);
 
 /*
- * Lookup an allocated object by object ID
+ * Lookup an allocated object by object ID, without locking
  * Returns a pointer to the object on success, returns NULL on error
  */
 object_base_p
@@ -578,11 +578,23 @@ rk_v4l2_assign_surface_bo(VADriverContextP ctx,
 		struct rk_enc_v4l2_context *video_ctx =
 			(struct rk_enc_v4l2_context*)obj_context->hw_context;
 
+		/*
+		 * The VPU would read the memory of the surface, or it is
+		 * copied from the memory of the caller.
+		 */
+		if ((video_ctx->import_input || obj_surface->external)
+			&& obj_surface->own_bo) {
+			obj_surface->bo = obj_surface->own_bo;
+			obj_surface->size = obj_surface->own_bo->plane[0].length;
+			return VA_STATUS_SUCCESS;
+		}
+
 		buffer = rk_v4l2_get_input_buffer(video_ctx->v4l2_ctx);
 		if (NULL == buffer)
 			return VA_STATUS_ERROR_OPERATION_FAILED;
 
 		obj_surface->bo = buffer;
+		obj_surface->size = 0;
 		for (uint32_t i = 0; i < buffer->length; i++) {
 			obj_surface->size += buffer->plane[i].length;
 		}
@@ -593,31 +605,16 @@ rk_v4l2_assign_surface_bo(VADriverContextP ctx,
 	{
 	/*
 	 * If the surface is not assigned a v4l2 buffer object in
-	 * Rockchip_EndPicture(), it means no result for it.
+	 * Rockchip_EndPicture(), it means no result for it, the
+	 * memory of the surface is given when it has one.
 	 */
-#if 0
-		struct rk_dec_v4l2_context *video_ctx =
-			(struct rk_dec_v4l2_context*)obj_context->hw_context;
-
-		buffer = rk_v4l2_get_output_buffer(video_ctx->v4l2_ctx);
-		if (NULL == buffer)
+		if (NULL == obj_surface->own_bo)
 			return VA_STATUS_ERROR_OPERATION_FAILED;
 
-		obj_surface->bo = buffer;
-		/* Zero can't pass the detect of gstreamer */
-		for (uint32_t i = 0; i < buffer->length; i++) {
-			obj_surface->size += buffer->plane[i].length;
-		}
-#endif
-		bool detect_flag = false;
+		obj_surface->bo = obj_surface->own_bo;
+		obj_surface->size = obj_surface->own_bo->plane[0].length;
 
-		if (!detect_flag) {
-			obj_surface->bo = malloc(4);
-			detect_flag = true;
-
-			return VA_STATUS_SUCCESS;
-		}
-		return VA_STATUS_ERROR_UNIMPLEMENTED;
+		return VA_STATUS_SUCCESS;
 	}
 		break;
 	default:
@@ -65,6 +65,10 @@ struct hw_context {
 	VASurfaceStatus (*get_status) 
 		(VADriverContextP ctx, VASurfaceID surface_id);
 	bool (*sync) (VADriverContextP ctx, VASurfaceID render_target);
+	/* Optional, back a VA buffer with the hardware memory */
+	struct rk_v4l2_buffer *(*alloc_buffer) (VADriverContextP ctx,
+			struct hw_context *hw_context, VABufferType type,
+			uint32_t size, uint32_t *offset);
 };
 
 struct hw_codec_info {
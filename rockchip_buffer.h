@@ -27,12 +27,66 @@
 #ifndef _ROCKCHIP_BUFFER_H_
 #define _ROCKCHIP_BUFFER_H_
 #include "common.h"
+#include <pthread.h>
+
+/* The payloads are recycled in power of two classes from 64 bytes */
+#define RK_POOL_MIN_SHIFT	6
+#define RK_POOL_NUM_CLASSES	16
+#define RK_POOL_MAX_PAYLOADS	8
+#define RK_POOL_MAX_STORES	64
+/* Beyond that the payloads go back to the system */
+#define RK_POOL_MAX_CACHED	(8 << 20)
+/* The parameters of a picture are bumped from an arena */
+#define RK_POOL_ARENA_SIZE	(64 << 10)
+#define RK_POOL_ARENA_MAX_ALLOC	(8 << 10)
+#define RK_POOL_ARENA_ALIGN	16
+
+struct rk_buffer_arena {
+	uint32_t used;
+	/* The payloads given out and not released yet */
+	int32_t live;
+	/* The payloads are rounded to the alignment, so is their base */
+	uint8_t data[RK_POOL_ARENA_SIZE]
+		__attribute__((aligned(RK_POOL_ARENA_ALIGN)));
+};
 
 struct buffer_store {
 	uint8_t *buffer;
 	struct rk_v4l2_buffer *bo;
 	int32_t ref_count;
 	int32_t num_elements;
+	/* Where the user data begins in the bo */
+	uint32_t offset;
+	/* Where it goes back to, the payload is recycled when capacity is set */
+	struct rk_buffer_pool *pool;
+	uint32_t capacity;
+	/* Or the payload is in an arena */
+	struct rk_buffer_arena *arena;
+	struct buffer_store *next_free;
+};
+
+/*
+ * The buffers of a context, the application creates and destroys the
+ * parameter and slice buffers for every frame.
+ */
+struct rk_buffer_pool {
+	pthread_mutex_t lock;
+	/* The context and every store taken from the pool */
+	int32_t ref_count;
+	bool closed;
+	struct buffer_store *free_stores;
+	uint32_t num_free_stores;
+	struct {
+		uint8_t *payloads[RK_POOL_MAX_PAYLOADS];
+		uint32_t num_payloads;
+	} classes[RK_POOL_NUM_CLASSES];
+	size_t cached_size;
+	/*
+	 * Rewound when the next picture begins, unless a buffer from it
+	 * is still kept, then it is left to its buffers and another is used.
+	 */
+	struct rk_buffer_arena *arena;
+	struct rk_buffer_arena *spare_arena;
 };
 
 #endif
@@ -28,11 +28,14 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #include <math.h>
 #include <sys/ioctl.h>
 #include <va/va.h>
 #include <va/va_backend.h>
+#include "config.h"
 #include "rockchip_driver.h"
+#include "rockchip_device_info.h"
 #include "rockchip_decoder_v4l2.h"
 #include "rockchip_debug.h"
 #include "v4l2_utils.h"
@@ -62,141 +65,952 @@ get_v4l2_codec(VAProfile profile)
 	return 0;
 }
 
+#ifndef DECODER_INPUT_BUFFERS
+#define DECODER_INPUT_BUFFERS	4
+#endif
+
+/* In ms, a picture is decoded in tens of ms */
+#define RK_DEC_JOB_TIMEOUT	2000
+
+/* Room for a start code before the slice data written by the user */
+#define SLICE_DATA_HEADROOM	3
+
+/* The nal_unit_type of the slices of an IDR picture */
+#define NAL_TYPE_SLICE_IDR	5
+
+#define MIN_BITSTREAM_SIZE	(256 * 1024)
+
+/* MaxFS in macroblocks and MaxCPB in 1000 bits, H.264 Table A-1 */
+static const struct {
+	uint32_t max_fs;
+	uint32_t max_cpb;
+} rk_avc_levels[] = {
+	{99, 350},		/* 1b */
+	{396, 2000},		/* 1.1 - 2 */
+	{792, 4000},		/* 2.1 */
+	{1620, 10000},		/* 2.2 - 3 */
+	{3600, 14000},		/* 3.1 */
+	{5120, 20000},		/* 3.2 */
+	{8192, 62500},		/* 4 - 4.1 */
+	{8704, 62500},		/* 4.2 */
+	{22080, 135000},	/* 5 */
+	{36864, 240000},	/* 5.1 - 5.2 */
+};
+
+/* 
+ * A picture is hardly larger than a half of the raw one, and never
+ * larger than the CPB of the lowest level which could hold its size.
+ */
+static uint32_t
+rk_dec_bitstream_size(VAProfile profile, int32_t width, int32_t height)
+{
+	uint32_t mbs = ((width + 15) / 16) * ((height + 15) / 16);
+	uint32_t size = width * height * 3 / 4;
+	uint32_t cpb;
+
+	for (uint32_t i = 0; i < ARRAY_ELEMS(rk_avc_levels); i++) {
+		if (rk_avc_levels[i].max_fs < mbs)
+			continue;
+
+		cpb = rk_avc_levels[i].max_cpb * 1000 / 8;
+		/* cpbBrVclFactor of the High profile */
+		if (VAProfileH264High == profile)
+			cpb = cpb * 5 / 4;
+		if (cpb < size)
+			size = cpb;
+		break;
+	}
+
+	if (size < MIN_BITSTREAM_SIZE)
+		size = MIN_BITSTREAM_SIZE;
+	size += SLICE_DATA_HEADROOM + H264D_STREAM_PADDING;
+
+	return ALIGN(size, 4096);
+}
+
+static void
+rk_dec_queue_capture(struct rk_dec_v4l2_context *ctx, int32_t index)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+	uint32_t slot;
+
+	if (video_ctx->ops.qbuf_output(video_ctx,
+				&video_ctx->output_buffer[index]))
+		return;
+
+	slot = (ctx->capture_head + ctx->num_queued_captures)
+		% VIDEO_MAX_FRAME;
+	ctx->capture_queue[slot] = index;
+	ctx->num_queued_captures++;
+}
+
+static int32_t
+rk_dec_next_capture(struct rk_dec_v4l2_context *ctx)
+{
+	int32_t index;
+
+	if (0 == ctx->num_queued_captures)
+		return -1;
+
+	index = ctx->capture_queue[ctx->capture_head];
+	ctx->capture_head = (ctx->capture_head + 1) % VIDEO_MAX_FRAME;
+	ctx->num_queued_captures--;
+
+	return index;
+}
+
+static bool
+rk_dec_capture_busy(struct rk_dec_v4l2_context *ctx, int32_t index)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < ctx->num_jobs; i++) {
+		slot = (ctx->job_head + i) % RK_DEC_MAX_PENDING_JOBS;
+		if (ctx->jobs[slot].capture_index == index)
+			return true;
+	}
+
+	return false;
+}
+
+static int32_t
+rk_dec_surface_slot(struct rk_dec_v4l2_context *ctx, VASurfaceID surface_id)
+{
+	for (uint32_t i = 0; i < ctx->num_capture_surfaces; i++)
+		if (ctx->capture_surfaces[i] == surface_id)
+			return i;
+
+	return -1;
+}
+
+/* Nobody uses the picture any more, the VPU could write it again */
+static void
+rk_dec_capture_release(struct rk_v4l2_buffer *bo, void *data)
+{
+	struct rk_dec_v4l2_context *ctx = (struct rk_dec_v4l2_context *)data;
+
+	rk_dec_queue_capture(ctx, bo->index);
+}
+
+static struct rk_v4l2_buffer *
+rk_dec_capture_buffer(struct rk_dec_v4l2_context *ctx, int32_t index)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+
+	if (index < 0 || index >= video_ctx->num_output_buffers)
+		return NULL;
+
+	return &video_ctx->output_buffer[index];
+}
+
+/* 
+ * Let the CAPTURE buffers go back to the VPU once their last user is
+ * done, the imported ones are reused when the application says so.
+ */
+static void
+rk_dec_setup_captures(struct rk_dec_v4l2_context *ctx)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+
+	for (int32_t i = 0; i < video_ctx->num_output_buffers; i++) {
+		video_ctx->output_buffer[i].ref_count = 0;
+		ctx->dpb_ref[i] = false;
+		if (ctx->import_capture)
+			continue;
+		video_ctx->output_buffer[i].release = rk_dec_capture_release;
+		video_ctx->output_buffer[i].release_data = ctx;
+		rk_dec_queue_capture(ctx, i);
+	}
+}
+
+/* Drop the references the parser has on the pictures it doesn't need */
 static void
 rk_dec_release(struct rk_dec_v4l2_context *ctx)
 {
 	int32_t index;
-	struct rk_v4l2_buffer buffer;
 
 	do {
 		index = h264d_get_unrefed_picture(ctx->wrapper_pdrvctx);
-		if (index >= 0) {
-			buffer.index = index;
-			ctx->v4l2_ctx->ops.qbuf_output(ctx->v4l2_ctx, &buffer);
-		}
+		if (index < 0)
+			break;
+		/* Dropped already, when the buffers were torn down */
+		if (index >= VIDEO_MAX_FRAME || !ctx->dpb_ref[index])
+			continue;
+		ctx->dpb_ref[index] = false;
+		v4l2_bo_unreference(rk_dec_capture_buffer(ctx, index));
 	}while(index >= 0);
 }
 
+/* 
+ * Drop the references of the parser and the hooks which requeue the
+ * CAPTURE buffers, before they are torn down. Those the application
+ * still holds are kept until it releases them.
+ */
+static void
+rk_dec_detach_captures(struct rk_dec_v4l2_context *ctx)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+	struct rk_v4l2_buffer *bo;
+
+	for (int32_t i = 0; i < video_ctx->num_output_buffers; i++) {
+		bo = &video_ctx->output_buffer[i];
+		bo->release = NULL;
+		bo->release_data = NULL;
+		if (i < VIDEO_MAX_FRAME && ctx->dpb_ref[i]) {
+			ctx->dpb_ref[i] = false;
+			v4l2_bo_unreference(bo);
+		}
+	}
+
+	ctx->capture_head = 0;
+	ctx->num_queued_captures = 0;
+}
+
+/* The context the surface was last decoded by, not the current one */
+static struct rk_dec_v4l2_context *
+rk_dec_surface_context(VADriverContextP ctx, VASurfaceID surface_id)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
+	struct object_surface *obj_surface = SURFACE(surface_id);
+	struct object_context *obj_context;
+
+	if (NULL == obj_surface || VA_INVALID_ID == obj_surface->context_id)
+		return NULL;
+
+	obj_context = CONTEXT(obj_surface->context_id);
+	if (NULL == obj_context || CODEC_DEC != obj_context->codec_type)
+		return NULL;
+
+	return (struct rk_dec_v4l2_context *)obj_context->hw_context;
+}
+
+static bool
+rk_dec_job_pending
+(struct rk_dec_v4l2_context *rk_ctx, VASurfaceID surface_id)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < rk_ctx->num_jobs; i++) {
+		slot = (rk_ctx->job_head + i) % RK_DEC_MAX_PENDING_JOBS;
+		if (rk_ctx->jobs[slot].surface == surface_id)
+			return true;
+	}
+
+	return false;
+}
+
+/* 
+ * Collect the oldest job, the VPU finishes the jobs in the order
+ * they were queued. It would block until the hardware is done.
+ */
+static bool
+rk_dec_retire_job(VADriverContextP ctx, struct rk_dec_v4l2_context *rk_ctx)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
+	struct rk_v4l2_object *video_ctx = rk_ctx->v4l2_ctx;
+	struct rk_v4l2_buffer *inbuf, *outbuf = NULL;
+	struct object_surface *obj_surface;
+	struct rk_dec_v4l2_job *job;
+
+	if (0 == rk_ctx->num_jobs)
+		return false;
+
+	/* Don't hang on a VPU which never finishes */
+	if (!rk_v4l2_wait_output_buffer(video_ctx, RK_DEC_JOB_TIMEOUT)) {
+		rk_error_msg("the VPU doesn't finish the job in %d ms\n",
+				RK_DEC_JOB_TIMEOUT);
+		return false;
+	}
+
+	job = &rk_ctx->jobs[rk_ctx->job_head];
+	rk_ctx->job_head = (rk_ctx->job_head + 1) % RK_DEC_MAX_PENDING_JOBS;
+	rk_ctx->num_jobs--;
+
+	/* Get decoded raw picture */
+	if (0 == video_ctx->ops.dqbuf_output(video_ctx, &outbuf)) {
+		if (outbuf->index != job->capture_index)
+			rk_error_msg("capture %d is decoded, expect %d\n",
+					outbuf->index, job->capture_index);
+	}
+	else {
+		outbuf = NULL;
+	}
+	/* release the input buffer */
+	video_ctx->ops.dqbuf_input(video_ctx, &inbuf);
+
+	/* The surface could be destroyed before we are here */
+	obj_surface = SURFACE(job->surface);
+	if (outbuf && obj_surface) {
+		obj_surface->bo = rk_ctx->import_capture ?
+			obj_surface->own_bo : outbuf;
+		/* The caller reads its own memory, not a capture buffer */
+		if (!rk_ctx->import_capture && obj_surface->external
+			&& v4l2_bo_copy_nv12(obj_surface->own_bo, outbuf,
+				obj_surface->orig_width,
+				obj_surface->orig_height))
+			obj_surface->bo = obj_surface->own_bo;
+		obj_surface->size = rk_v4l2_buffer_total_bytesused(outbuf);
+	}
+
+	/* The VPU is done with it, it may be requeued now */
+	v4l2_bo_unreference(rk_dec_capture_buffer(rk_ctx,
+				job->capture_index));
+
+	return true;
+}
+
+/* 
+ * Queue the memory of the surface at its slot, the slices of it
+ * decoded before have to be back first.
+ */
+static void
+rk_dec_queue_surface(VADriverContextP va_ctx,
+		struct rk_dec_v4l2_context *ctx, VASurfaceID surface_id)
+{
+	int32_t slot = rk_dec_surface_slot(ctx, surface_id);
+
+	if (slot < 0)
+		return;
+
+	while (rk_dec_capture_busy(ctx, slot)
+			&& rk_dec_retire_job(va_ctx, ctx));
+	rk_dec_queue_capture(ctx, slot);
+}
+
+static bool
+rk_dec_v4l2_sync(VADriverContextP ctx, VASurfaceID render_target)
+{
+	struct rk_dec_v4l2_context *rk_ctx =
+		rk_dec_surface_context(ctx, render_target);
+
+	if (NULL == rk_ctx)
+		return false;
+
+	while (rk_dec_job_pending(rk_ctx, render_target)) {
+		if (!rk_dec_retire_job(ctx, rk_ctx))
+			return false;
+	}
+
+	return true;
+}
+
+static VASurfaceStatus
+rk_dec_v4l2_get_status(VADriverContextP ctx, VASurfaceID surface_id)
+{
+	struct rk_dec_v4l2_context *rk_ctx =
+		rk_dec_surface_context(ctx, surface_id);
+
+	if (NULL == rk_ctx)
+		return VASurfaceReady;
+
+	while (rk_dec_job_pending(rk_ctx, surface_id)) {
+		/* Only collect what the VPU has finished, never block */
+		if (!rk_v4l2_wait_output_buffer(rk_ctx->v4l2_ctx, 0))
+			return VASurfaceRendering;
+		rk_dec_retire_job(ctx, rk_ctx);
+	}
+
+	return VASurfaceReady;
+}
+
+static bool
+rk_dec_own_bitstream(struct rk_dec_v4l2_context *ctx, struct rk_v4l2_buffer *bo)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+
+	return bo >= video_ctx->input_buffer
+		&& bo < video_ctx->input_buffer + video_ctx->num_input_buffers;
+}
+
+/* Drop the slices of a picture failed to be submitted */
+static void
+rk_dec_drop_pending(struct rk_dec_v4l2_context *ctx)
+{
+	if (NULL == ctx->pending_inbuf)
+		return;
+
+	rk_v4l2_put_input_buffer(ctx->v4l2_ctx, ctx->pending_inbuf);
+	ctx->pending_inbuf = NULL;
+}
+
+/* Hand a bitstream buffer to the application for the slice data */
 static struct rk_v4l2_buffer *
+rk_dec_v4l2_alloc_buffer(VADriverContextP ctx, struct hw_context *hw_context,
+		VABufferType type, uint32_t size, uint32_t *offset)
+{
+	struct rk_dec_v4l2_context *rk_ctx =
+		(struct rk_dec_v4l2_context *)hw_context;
+	struct rk_v4l2_object *video_ctx = rk_ctx->v4l2_ctx;
+	struct rk_v4l2_buffer *inbuf;
+	uint32_t num_claimed = 0;
+
+	if (VASliceDataBufferType != type || NULL == video_ctx)
+		return NULL;
+
+	for (uint32_t i = 0; i < video_ctx->num_input_buffers; i++)
+		if (BUFFER_CLAIMED == video_ctx->input_buffer[i].state)
+			num_claimed++;
+	/* Keep one for the slices which have to be copied */
+	if (num_claimed + 1 >= video_ctx->num_input_buffers)
+		return NULL;
+
+	inbuf = rk_v4l2_get_input_buffer(video_ctx);
+	if (NULL == inbuf || inbuf->plane[0].length <
+		SLICE_DATA_HEADROOM + size + H264D_STREAM_PADDING)
+		return NULL;
+	/* The application writes it through the CPU */
+	if (NULL == v4l2_bo_map(inbuf, 0))
+		return NULL;
+
+	inbuf = rk_v4l2_acquire_input_buffer(video_ctx, 0);
+	inbuf->state = BUFFER_CLAIMED;
+	/* Dropped by the slice data buffer, unless it is submitted */
+	inbuf->ref_count = 1;
+	*offset = SLICE_DATA_HEADROOM;
+
+	return inbuf;
+}
+
+static void
+rk_dec_invalidate_controls(struct rk_dec_v4l2_context *ctx)
+{
+	for (uint32_t r = 0; r <= RK_V4L2_MAX_REQUESTS; r++)
+		for (uint32_t i = 0; i < RK_DEC_NUM_CACHED_CTRLS; i++)
+			ctx->ctrl_cache[r][i].valid = false;
+}
+
+/* Whether the payload differs from the one the cache holds, kept if so */
+static bool
+rk_dec_control_update(struct rk_dec_ctrl_cache *cache,
+		const void *payload, uint32_t size)
+{
+	if (size > sizeof(cache->payload)) {
+		cache->valid = false;
+		return true;
+	}
+
+	if (cache->valid && cache->size == size
+			&& !memcmp(&cache->payload, payload, size))
+		return false;
+
+	memcpy(&cache->payload, payload, size);
+	cache->size = size;
+	cache->valid = true;
+	return true;
+}
+
+/* 
+ * Whether the control must be set with the request, it is skipped
+ * only when both the last submitted and the request ID have it.
+ */
+static bool
+rk_dec_control_changed(struct rk_dec_v4l2_context *ctx, uint16_t request,
+		uint32_t id, const void *payload, uint32_t size)
+{
+	bool changed;
+
+	if (0 == request || request > RK_V4L2_MAX_REQUESTS)
+		return true;
+
+	for (uint32_t i = 0; i < RK_DEC_NUM_CACHED_CTRLS; i++) {
+		if (ctx->ctrl_cache[0][i].id != id)
+			continue;
+
+		changed = rk_dec_control_update(&ctx->ctrl_cache[0][i],
+				payload, size);
+		if (rk_dec_control_update(&ctx->ctrl_cache[request][i],
+					payload, size))
+			changed = true;
+		return changed;
+	}
+
+	/* The slice and decode params are new for every request */
+	return true;
+}
+
+/* 
+ * The slice could be decoded from where the application wrote it,
+ * when it is at the beginning of a bitstream buffer of ours.
+ */
+static bool
+rk_dec_slice_in_place(struct rk_dec_v4l2_context *ctx,
+		struct buffer_store *slice_data,
+		VASliceParameterBufferH264 *slice_param)
+{
+	struct rk_v4l2_buffer *bo = slice_data->bo;
+
+	if (NULL == bo || BUFFER_CLAIMED != bo->state)
+		return false;
+	if (!rk_dec_own_bitstream(ctx, bo))
+		return false;
+
+	return 0 == slice_param->slice_data_offset;
+}
+
+static VAStatus
 rk_dec_procsss_avc_object
-(struct rk_dec_v4l2_context *ctx,
+(VADriverContextP va_ctx, struct rk_dec_v4l2_context *ctx,
+ VASurfaceID surface_id,
  VAPictureParameterBufferH264 *pic_param, 
  VASliceParameterBufferH264 *slice_param,
  VASliceParameterBufferH264 *next_slice_param,
- uint8_t *slice_data)
+ uint8_t *slice_data, struct rk_v4l2_buffer *slice_bo)
 {
 	bool is_frame = false;
-	uint32_t num_ctrls;
-	uint32_t ctrl_ids[5];
-	uint32_t payload_sizes[5];
-	struct v4l2_ctrl_h264_sps *sps;
-	struct v4l2_ctrl_h264_pps *pps;
+	size_t num_ctrls;
+	uint32_t ctrl_ids[RK_DEC_MAX_CTRLS];
+	uint32_t payload_sizes[RK_DEC_MAX_CTRLS];
 	struct v4l2_ext_controls ext_ctrls;
-	struct rk_v4l2_buffer *inbuf, *outbuf;
+	struct rk_v4l2_buffer *inbuf;
+	struct rk_dec_v4l2_job *job;
+	int32_t capture_index;
 	uint8_t *ptr, *ptr2, *nal_ptr;
 	uint8_t start_code_prefix[3] = {0x00, 0x00, 0x01};
 
-	void *payloads[5];
+	void *payloads[RK_DEC_MAX_CTRLS];
 
-	inbuf = rk_v4l2_get_input_buffer(ctx->v4l2_ctx);
-	/* Not get validate buffer */
-	if (NULL == inbuf)
-		return NULL;
-	/* FIXME overflow risk here */
-	ptr = inbuf->plane[0].data + inbuf->plane[0].bytesused;
 	nal_ptr = slice_data + slice_param->slice_data_offset;
 
-	if (memcmp(nal_ptr, start_code_prefix, sizeof(start_code_prefix)) != 0) 
-	{
-		memcpy(ptr, &start_code_prefix, sizeof(start_code_prefix));
-		ptr2 = ptr + sizeof(start_code_prefix);
-		inbuf->plane[0].bytesused += sizeof(start_code_prefix);
+	inbuf = ctx->pending_inbuf;
+	if (NULL == inbuf) {
+		if (NULL != slice_bo)
+			inbuf = slice_bo;
+		else
+			inbuf = rk_v4l2_acquire_input_buffer(ctx->v4l2_ctx, 0);
+		/* 
+		 * All the bitstream buffers are in the VPU, wait for one,
+		 * the jobs have to be retired in order.
+		 */
+		while (NULL == inbuf && rk_dec_retire_job(va_ctx, ctx))
+			inbuf = rk_v4l2_acquire_input_buffer(ctx->v4l2_ctx, 0);
+		/* Not get validate buffer */
+		if (NULL == inbuf)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+		if (NULL == v4l2_bo_map(inbuf, 0)) {
+			if (inbuf != slice_bo)
+				rk_v4l2_put_input_buffer(ctx->v4l2_ctx, inbuf);
+			return VA_STATUS_ERROR_OPERATION_FAILED;
+		}
+
+		/* The CAPTURE buffers could be all held by the pending jobs */
+		while (!ctx->import_capture && 0 == ctx->num_queued_captures
+				&& rk_dec_retire_job(va_ctx, ctx));
 	}
-	else {
-		ptr2 = ptr;
+
+	if (inbuf == slice_bo && 0 == inbuf->plane[0].bytesused) {
+		/* The slice is already in place, fill the headroom */
+		ptr = inbuf->plane[0].data;
+		if (memcmp(nal_ptr, start_code_prefix,
+				sizeof(start_code_prefix)) != 0)
+			memcpy(ptr, start_code_prefix,
+					sizeof(start_code_prefix));
+		else
+			/* leading zero bytes */
+			memset(ptr, 0, SLICE_DATA_HEADROOM);
+		inbuf->plane[0].bytesused = SLICE_DATA_HEADROOM;
+		ptr2 = nal_ptr;
 	}
+	else {
+		/* The bitstream buffer is grown for the picture before */
+		if (inbuf->plane[0].bytesused + sizeof(start_code_prefix)
+			+ slice_param->slice_data_size > inbuf->plane[0].length) {
+			rk_error_msg("slice of %u bytes overflows the "
+					"bitstream buffer\n",
+					slice_param->slice_data_size);
+			rk_dec_drop_pending(ctx);
+			return VA_STATUS_ERROR_INVALID_BUFFER;
+		}
+
+		ptr = inbuf->plane[0].data + inbuf->plane[0].bytesused;
 
-	memcpy(ptr2, nal_ptr, slice_param->slice_data_size);
+		if (memcmp(nal_ptr, start_code_prefix,
+				sizeof(start_code_prefix)) != 0) 
+		{
+			memcpy(ptr, &start_code_prefix,
+					sizeof(start_code_prefix));
+			ptr2 = ptr + sizeof(start_code_prefix);
+			inbuf->plane[0].bytesused += sizeof(start_code_prefix);
+		}
+		else {
+			ptr2 = ptr;
+		}
+
+		/* The source could be in the same buffer */
+		memmove(ptr2, nal_ptr, slice_param->slice_data_size);
+	}
 	inbuf->plane[0].bytesused += slice_param->slice_data_size;
 
+	/* The parser reads the bitstream buffer if there is room for
+	 * the padding it needs */
+	if (inbuf->plane[0].length - inbuf->plane[0].bytesused
+			>= H264D_STREAM_PADDING) {
+		memset((uint8_t *)inbuf->plane[0].data
+				+ inbuf->plane[0].bytesused, 0,
+				H264D_STREAM_PADDING);
+		h264d_set_stream_in_place(ctx->wrapper_pdrvctx, true);
+	}
+	else {
+		h264d_set_stream_in_place(ctx->wrapper_pdrvctx, false);
+	}
+
 	/* Process a nal a times
 	 * If it return true, it could be a complete frame to be decode.
 	 * But in my design it won't be trun unless the last buffer */
 	is_frame = h264d_prepare_data_raw(ctx->wrapper_pdrvctx, 
-		ptr, slice_param->slice_data_size + sizeof(start_code_prefix),
+		ptr, ptr2 - ptr + slice_param->slice_data_size,
 		&num_ctrls, ctrl_ids, payloads, payload_sizes);
 
-	/* Not the last slice */
-#if 0
-	if (!is_frame) {
-		if (NULL == next_slice_param)
-			inbuf->plane[0].bytesused = 0;
-		return -1;
+	/* Not the last slice, keep packing the picture */
+	if (ctx->frame_mode && NULL != next_slice_param) {
+		ctx->pending_inbuf = inbuf;
+		return VA_STATUS_SUCCESS;
 	}
-#else
-	if (NULL != next_slice_param)
-		NULL;
-#endif
+	ctx->pending_inbuf = NULL;
 
-	sps = (struct v4l2_ctrl_h264_sps *)payloads[0];
-	pps = (struct v4l2_ctrl_h264_pps *)payloads[1];
-
-	pps->weighted_bipred_idc = 
-		pic_param->pic_fields.bits.weighted_bipred_idc;
-	pps->pic_init_qp_minus26 = pic_param->pic_init_qp_minus26;
-	pps->chroma_qp_index_offset =
-		pic_param->chroma_qp_index_offset;
-	pps->second_chroma_qp_index_offset = 
-		pic_param->second_chroma_qp_index_offset;
-
-	pps->num_ref_idx_l0_default_active_minus1 = 
-		slice_param->num_ref_idx_l0_active_minus1;
-	pps->num_ref_idx_l1_default_active_minus1 = 
-		slice_param->num_ref_idx_l1_active_minus1;
-
-	sps->log2_max_frame_num_minus4 = 
-		pic_param->seq_fields.bits.log2_max_frame_num_minus4;
-	sps->log2_max_pic_order_cnt_lsb_minus4 =
-		pic_param->seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4;
-	sps->pic_order_cnt_type =
-		pic_param->seq_fields.bits.pic_order_cnt_type;
+	/* The VPU gets all the slices with a single request */
+	if (ctx->frame_mode)
+		h264d_get_slice_params(ctx->wrapper_pdrvctx,
+				&payloads[3], &payload_sizes[3]);
 
 	memset(&ext_ctrls, 0, sizeof(ext_ctrls));
-	ext_ctrls.count = num_ctrls;
-	ext_ctrls.controls = calloc(num_ctrls,
-			sizeof(struct v4l2_ext_control));
-	ext_ctrls.request = inbuf->index;
+	ext_ctrls.controls = ctx->ctrls;
+	/* A request for each frame in flight, the oldest gives back its */
+	while (0 == rk_v4l2_request_alloc(ctx->v4l2_ctx, inbuf)
+			&& rk_dec_retire_job(va_ctx, ctx));
+	/* The controls without a request would apply to the stream at once */
+	if (0 == inbuf->request) {
+		rk_error_msg("no request is free for the picture\n");
+		rk_v4l2_put_input_buffer(ctx->v4l2_ctx, inbuf);
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
+	ext_ctrls.request = inbuf->request;
 
 	for (uint8_t i = 0; i < num_ctrls; ++i) {
-		ext_ctrls.controls[i].id = ctrl_ids[i];
-		ext_ctrls.controls[i].ptr = payloads[i];
-		ext_ctrls.controls[i].size = payload_sizes[i];
+		struct v4l2_ext_control *ctrl;
+
+		/* Both the request before and the request ID have it */
+		if (!rk_dec_control_changed(ctx, inbuf->request, ctrl_ids[i],
+					payloads[i], payload_sizes[i]))
+			continue;
+
+		ctrl = &ext_ctrls.controls[ext_ctrls.count++];
+		ctrl->id = ctrl_ids[i];
+		ctrl->ptr = payloads[i];
+		ctrl->size = payload_sizes[i];
 	}
 	/* Set codec parameters need by VPU */
-	ioctl(ctx->v4l2_ctx->video_fd, VIDIOC_S_EXT_CTRLS, &ext_ctrls);
+	if (rk_v4l2_ioctl(ctx->v4l2_ctx->video_fd, VIDIOC_S_EXT_CTRLS,
+				&ext_ctrls) < 0) {
+		rk_error_msg("failed to set the controls: %s\n",
+				strerror(errno));
+		rk_dec_invalidate_controls(ctx);
+		/* The request goes back with the buffer, no job is made */
+		rk_v4l2_put_input_buffer(ctx->v4l2_ctx, inbuf);
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+	}
 
-	free(ext_ctrls.controls);
 	/* Push codec data to driver */
-	ctx->v4l2_ctx->ops.qbuf_input(ctx->v4l2_ctx, inbuf);
+	if (ctx->v4l2_ctx->ops.qbuf_input(ctx->v4l2_ctx, inbuf)) {
+		rk_dec_invalidate_controls(ctx);
+		rk_v4l2_put_input_buffer(ctx->v4l2_ctx, inbuf);
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+	}
 
-	/* Get decoded raw picture */
-	if (0 == ctx->v4l2_ctx->ops.dqbuf_output(ctx->v4l2_ctx, &outbuf))
-	{
-		h264d_picture_ready(ctx->wrapper_pdrvctx, outbuf->index);
+	/* The surface is only queued for a job which would complete */
+	if (ctx->import_capture)
+		rk_dec_queue_surface(va_ctx, ctx, surface_id);
+	capture_index = rk_dec_next_capture(ctx);
+
+	/* Record the job, the result is collected at sync time */
+	if (RK_DEC_MAX_PENDING_JOBS == ctx->num_jobs)
+		rk_dec_retire_job(va_ctx, ctx);
+
+	job = &ctx->jobs[(ctx->job_head + ctx->num_jobs)
+		% RK_DEC_MAX_PENDING_JOBS];
+	job->surface = surface_id;
+	job->inbuf = inbuf;
+	job->capture_index = capture_index;
+	ctx->num_jobs++;
+
+	if (capture_index >= 0) {
+		/* One for the job, one for the DPB of the parser */
+		v4l2_bo_reference(rk_dec_capture_buffer(ctx, capture_index));
+		v4l2_bo_reference(rk_dec_capture_buffer(ctx, capture_index));
+		ctx->dpb_ref[capture_index] = true;
+		/* 
+		 * Let the parser know the output buffer now, so the
+		 * next picture could be parsed while this one is still
+		 * in the VPU.
+		 */
+		h264d_picture_ready(ctx->wrapper_pdrvctx, capture_index);
 		/* Release the last time output buffer, the libvpu
 		 * would determind which buffers are not the last
 		 * buffer in capture then this function would release
 		 * it and enqueue the CAPTURE */
 		rk_dec_release(ctx);
 	}
-	/* release the input buffer */
-	ctx->v4l2_ctx->ops.dqbuf_input(ctx->v4l2_ctx, &inbuf);
 
-	return outbuf;
+	if (!ctx->async)
+		while (rk_dec_retire_job(va_ctx, ctx));
+
+	return VA_STATUS_SUCCESS;
 }
 
 #define MAX_CAPTURE_BUFFERS   22
 
+/* 
+ * The DPB of the parser, the picture being decoded, and the ones
+ * in the VPU which are not kept by the DPB.
+ */
+static uint32_t
+rk_dec_capture_count(struct rk_dec_v4l2_context *ctx, int32_t dpb_size)
+{
+	uint32_t count;
+
+	count = dpb_size + 1 + (ctx->async ? DECODER_INPUT_BUFFERS : 1);
+	if (count > MAX_CAPTURE_BUFFERS)
+		count = MAX_CAPTURE_BUFFERS;
+
+	return count;
+}
+
+/* 
+ * Copy the pictures the surfaces have in the CAPTURE buffers to their
+ * own memory, before those buffers are torn down. The images derived
+ * from the old buffers keep them until they are destroyed.
+ */
+static void
+rk_dec_migrate_surfaces(VADriverContextP va_ctx,
+		struct rk_dec_v4l2_context *ctx)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(va_ctx);
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+	struct object_surface *obj_surface;
+	object_heap_iterator iter;
+
+	obj_surface = (struct object_surface *)
+		object_heap_first(&rk_data->surface_heap, &iter);
+	while (obj_surface) {
+		if (obj_surface->bo >= video_ctx->output_buffer
+			&& obj_surface->bo < video_ctx->output_buffer
+			+ video_ctx->num_output_buffers) {
+			if (v4l2_bo_copy_nv12(obj_surface->own_bo,
+					obj_surface->bo,
+					obj_surface->orig_width,
+					obj_surface->orig_height)) {
+				obj_surface->bo = obj_surface->own_bo;
+				obj_surface->size =
+					obj_surface->own_bo->plane[0].length;
+			}
+			else {
+				rk_error_msg("surface %d loses its picture\n",
+						obj_surface->base.id);
+				obj_surface->bo = NULL;
+				obj_surface->size = 0;
+			}
+		}
+		obj_surface = (struct object_surface *)
+			object_heap_next(&rk_data->surface_heap, &iter);
+	}
+}
+
+/* The type of the NAL unit, after the start code it may begin with */
+static uint32_t
+rk_dec_nal_unit_type(const uint8_t *data, uint32_t size)
+{
+	uint32_t i = 0;
+
+	while (i < size && 0 == data[i])
+		i++;
+	if (i >= 2 && i < size && 1 == data[i])
+		i++;
+	else
+		i = 0;
+
+	return i < size ? data[i] & 0x1f : 0;
+}
+
+/* Whether no picture is kept in the CAPTURE buffers */
+static bool
+rk_dec_captures_idle(struct rk_dec_v4l2_context *ctx)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+
+	for (int32_t i = 0; i < video_ctx->num_output_buffers; i++)
+		if (video_ctx->output_buffer[i].ref_count > 0)
+			return false;
+
+	return true;
+}
+
+/* 
+ * Reallocate the CAPTURE buffers for a new DPB size, the parser drops
+ * all its pictures when the SPS changes the DPB size. That is only at
+ * an IDR picture, none of the pictures before is a reference then.
+ */
+static VAStatus
+rk_dec_resize_capture(VADriverContextP va_ctx,
+		struct rk_dec_v4l2_context *ctx, uint32_t count)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+	int32_t ret;
+
+	rk_info_msg("resize the CAPTURE buffers from %d to %u\n",
+			video_ctx->num_output_buffers, count);
+
+	while (rk_dec_retire_job(va_ctx, ctx));
+
+	/* The pictures waiting to be shown are kept by their surfaces */
+	rk_dec_migrate_surfaces(va_ctx, ctx);
+
+	rk_dec_detach_captures(ctx);
+	/* The streams are restarted */
+	rk_dec_invalidate_controls(ctx);
+
+	ret = rk_v4l2_dec_resize_output(video_ctx, count);
+	if (0 == ret)
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+	rk_dec_setup_captures(ctx);
+
+	return VA_STATUS_SUCCESS;
+}
+
+/* The size of a bitstream buffer the slices would be packed in */
+static uint32_t
+rk_dec_avc_bitstream_need(struct rk_dec_v4l2_context *ctx,
+		struct decode_state *decode_state)
+{
+	VASliceParameterBufferH264 *slice_param;
+	uint32_t total = 0, max = 0, size;
+
+	for (int32_t i = 0; i < decode_state->num_slice_params; i++) {
+		slice_param = (VASliceParameterBufferH264 *)
+			decode_state->slice_params[i]->buffer;
+		for (int32_t j = 0;
+			j < decode_state->slice_params[i]->num_elements; j++) {
+			/* with a start code */
+			size = slice_param[j].slice_data_size + 3;
+			total += size;
+			if (size > max)
+				max = size;
+		}
+	}
+
+	return (ctx->frame_mode ? total : max) + SLICE_DATA_HEADROOM;
+}
+
+/* 
+ * Reallocate the bitstream buffers for a picture which doesn't fit.
+ * The slices the application wrote in the old buffers are copied out.
+ */
+static VAStatus
+rk_dec_grow_bitstream(VADriverContextP va_ctx,
+		struct rk_dec_v4l2_context *ctx,
+		struct decode_state *decode_state, uint32_t size)
+{
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+	struct buffer_store *store;
+	uint32_t new_size, length;
+
+	new_size = video_ctx->bitstream_size;
+	if (new_size < MIN_BITSTREAM_SIZE)
+		new_size = MIN_BITSTREAM_SIZE;
+	while (new_size < size + H264D_STREAM_PADDING)
+		new_size *= 2;
+
+	rk_info_msg("grow the bitstream buffers to %u bytes\n", new_size);
+
+	/* All the bitstream buffers have to be back from the VPU */
+	while (rk_dec_retire_job(va_ctx, ctx));
+
+	for (int32_t i = 0; i < decode_state->num_slice_datas; i++) {
+		store = decode_state->slice_datas[i];
+		if (NULL == store->bo || !rk_dec_own_bitstream(ctx, store->bo))
+			continue;
+
+		length = store->bo->plane[0].length - store->offset;
+		store->buffer = malloc(length);
+		if (NULL == store->buffer)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+		memcpy(store->buffer, (uint8_t *)v4l2_bo_map(store->bo, 0)
+				+ store->offset, length);
+		rk_v4l2_put_input_buffer(video_ctx, store->bo);
+		store->bo = NULL;
+		store->offset = 0;
+	}
+
+	for (int32_t i = 0; i < video_ctx->num_input_buffers; i++) {
+		if (BUFFER_CLAIMED == video_ctx->input_buffer[i].state) {
+			rk_error_msg("bitstream buffer %d is still claimed\n",
+					i);
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+		}
+	}
+
+	rk_dec_invalidate_controls(ctx);
+	if (!rk_v4l2_dec_resize_input(video_ctx, new_size))
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+	return VA_STATUS_SUCCESS;
+}
+
+/* 
+ * Use the memory of the render targets as the CAPTURE buffers, when
+ * all of them are large enough for a picture.
+ */
+static bool
+rk_dec_import_capture(VADriverContextP va_ctx,
+		struct rk_dec_v4l2_context *ctx,
+		struct object_context *obj_context)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(va_ctx);
+	struct rk_v4l2_object *video_ctx = ctx->v4l2_ctx;
+	struct object_surface *obj_surface;
+	uint32_t sizeimage, count;
+
+	count = obj_context->num_render_targets;
+	if (0 == count || count > VIDEO_MAX_FRAME
+		|| NULL == obj_context->render_targets)
+		return false;
+
+	/* A surface is a single dma-buf */
+	if (video_ctx->output_format.fmt.pix_mp.num_planes > 1)
+		return false;
+
+	sizeimage = video_ctx->output_format.fmt.pix_mp.plane_fmt[0].sizeimage;
+	for (uint32_t i = 0; i < count; i++) {
+		obj_surface = SURFACE(obj_context->render_targets[i]);
+		if (NULL == obj_surface || NULL == obj_surface->own_bo
+			|| obj_surface->own_bo->plane[0].length < sizeimage)
+			return false;
+		/* The pitches of the caller are not changed */
+		if (obj_surface->external && !rk_v4l2_buffer_fits_format
+			(obj_surface->own_bo, &video_ctx->output_format))
+			return false;
+	}
+
+	rk_v4l2_set_output_memory(video_ctx, V4L2_MEMORY_DMABUF);
+	if (video_ctx->ops.output_alloc(video_ctx, count) != count) {
+		rk_info_msg("Failed to import the surfaces as CAPTURE\n");
+		rk_v4l2_set_output_memory(video_ctx, V4L2_MEMORY_MMAP);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		obj_surface = SURFACE(obj_context->render_targets[i]);
+		rk_v4l2_buffer_attach(&video_ctx->output_buffer[i],
+				obj_surface->own_bo);
+		/* The VPU writes it in its own pitch */
+		rk_v4l2_buffer_set_layout(obj_surface->own_bo,
+				&video_ctx->output_format);
+		ctx->capture_surfaces[i] = obj_context->render_targets[i];
+	}
+	ctx->num_capture_surfaces = count;
+
+	return true;
+}
+
 static VAStatus
 rk_dec_v4l2_avc_decode_picture
 (VADriverContextP ctx,  union codec_state *codec_state, 
@@ -207,10 +1021,13 @@ rk_dec_v4l2_avc_decode_picture
 	struct rk_dec_v4l2_context *rk_v4l2_data =
 		(struct rk_dec_v4l2_context *)hw_context;
 	struct rk_v4l2_object *video_ctx = rk_v4l2_data->v4l2_ctx;
-	struct rk_v4l2_buffer *outbuf;
 	struct decode_state *decode_state = &codec_state->decode;
 
 	uint8_t *slice_data;
+	struct buffer_store *slice_data_store;
+	struct rk_v4l2_buffer *slice_bo;
+	uint32_t size, count;
+	VAStatus va_status;
 	VAPictureParameterBufferH264 *pic_param = NULL;
 	VASliceParameterBufferH264 *slice_param, *next_slice_param, 
 				   *next_slice_group_param;
@@ -226,6 +1043,8 @@ rk_dec_v4l2_avc_decode_picture
 	obj_surface =
 	SURFACE(obj_context->codec_state.decode.current_render_target);
 	ASSERT(obj_surface);
+	/* Its job is waited for in this context, whichever is current */
+	obj_surface->context_id = obj_context->base.id;
 
 	assert(decode_state->pic_param && decode_state->pic_param->buffer);
 	pic_param = (VAPictureParameterBufferH264 *)decode_state->pic_param->buffer;
@@ -235,16 +1054,37 @@ rk_dec_v4l2_avc_decode_picture
 	else
 		obj_surface->flags &= ~SURFACE_REFERENCED;
 
+	/* Only the render targets have a slot in the CAPTURE queue */
+	if (rk_v4l2_data->import_capture &&
+		rk_dec_surface_slot(rk_v4l2_data, obj_surface->base.id) < 0)
+		return VA_STATUS_ERROR_INVALID_SURFACE;
+
 	if (!video_ctx->input_streamon)
 		rk_v4l2_streamon_all(video_ctx);
 
+	rk_dec_drop_pending(rk_v4l2_data);
+
+	size = rk_dec_avc_bitstream_need(rk_v4l2_data, decode_state);
+	if (0 == video_ctx->num_input_buffers
+		|| size > video_ctx->input_buffer[0].plane[0].length) {
+		va_status = rk_dec_grow_bitstream(ctx, rk_v4l2_data,
+				decode_state, size);
+		if (VA_STATUS_SUCCESS != va_status)
+			return va_status;
+	}
+
 	for (int32_t i = 0; i < decode_state->num_slice_params; i++)
 	{
 		assert(decode_state->slice_params 
 				&& decode_state->slice_params[i]->buffer);
 		slice_param = (VASliceParameterBufferH264 *)
 			decode_state->slice_params[i]->buffer;
-		slice_data = decode_state->slice_datas[i]->buffer;
+		slice_data_store = decode_state->slice_datas[i];
+		if (slice_data_store->bo)
+			slice_data = (uint8_t *)slice_data_store->bo->plane[0].data
+				+ slice_data_store->offset;
+		else
+			slice_data = slice_data_store->buffer;
 
 		if (i == decode_state->num_slice_params - 1)
 			next_slice_group_param = NULL;
@@ -263,6 +1103,27 @@ rk_dec_v4l2_avc_decode_picture
 			rk_v4l2_data->profile, obj_surface->width,
 			obj_surface->height, pic_param, slice_param);
 
+		/* 
+		 * The SPS could change the DPB size, at an IDR picture or
+		 * before any picture is decoded.
+		 */
+		if (0 == i && !rk_v4l2_data->import_capture) {
+			count = rk_dec_capture_count(rk_v4l2_data,
+				h264d_get_dpb_size(rk_v4l2_data->wrapper_pdrvctx,
+					obj_surface->width, obj_surface->height));
+			if (count != video_ctx->num_output_buffers
+				&& (NAL_TYPE_SLICE_IDR == rk_dec_nal_unit_type(
+				slice_data + slice_param->slice_data_offset,
+				slice_param->slice_data_size)
+				|| rk_dec_captures_idle(rk_v4l2_data)))
+				va_status = rk_dec_resize_capture(ctx,
+						rk_v4l2_data, count);
+			else
+				va_status = VA_STATUS_SUCCESS;
+			if (VA_STATUS_SUCCESS != va_status)
+				return va_status;
+		}
+
 		/* Process the number of slices that the param order */
 		for (int32_t j = 0; 
 			j < decode_state->slice_params[i]->num_elements; j++)
@@ -285,17 +1146,29 @@ rk_dec_v4l2_avc_decode_picture
 				next_slice_param = slice_param + 1;
 			else
 				next_slice_param = next_slice_group_param;
+
+			/* 
+			 * Submit the buffer the slice is written in if it is
+			 * the only slice of it, the VPU takes the buffer from
+			 * us. The slices after it would be moved over the
+			 * ones not moved yet by the start codes.
+			 */
+			slice_bo = NULL;
+			if (NULL == rk_v4l2_data->pending_inbuf && 1 ==
+				decode_state->slice_params[i]->num_elements
+				&& rk_dec_slice_in_place(rk_v4l2_data,
+					slice_data_store, slice_param)) {
+				slice_bo = slice_data_store->bo;
+				slice_data_store->bo = NULL;
+			}
+
 			/* Hardware job begin here */
-			outbuf = rk_dec_procsss_avc_object(rk_v4l2_data, pic_param,
+			va_status = rk_dec_procsss_avc_object(ctx, rk_v4l2_data,
+					obj_surface->base.id, pic_param,
 					slice_param, next_slice_param, 
-					slice_data);
-			/* Get validate frame */
-			if (outbuf)
-			{
-				obj_surface->bo = outbuf;
-				obj_surface->size =
-					rk_v4l2_buffer_total_bytesused(outbuf);
-			}
+					slice_data, slice_bo);
+			if (VA_STATUS_SUCCESS != va_status)
+				return va_status;
 
 			/* Hardware job end here */
 			slice_param++;
@@ -338,6 +1211,8 @@ decoder_rk_v4l2_init
 		(struct rk_dec_v4l2_context *)hw_context;
 	struct rk_v4l2_object *video_ctx;
 	struct object_config *obj_config;
+	struct rk_v4l2_device_info *device;
+	int64_t pixels;
 
 	uint32_t v4l2_codec_type;
 	int32_t ret = 0;
@@ -349,46 +1224,85 @@ decoder_rk_v4l2_init
 	ASSERT_RET(obj_config, VA_STATUS_ERROR_INVALID_CONFIG);
 	
 	rk_v4l2_data->profile = obj_config->profile;
+	rk_v4l2_data->va_ctx = ctx;
+	rk_v4l2_data->context_id = obj_context->base.id;
 
 	v4l2_codec_type = get_v4l2_codec(obj_config->profile);
 	if (!v4l2_codec_type)
 		return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
 
-	/* Create RK V4L2 Object */
-	video_ctx = rk_v4l2_dec_create(NULL);
-	if (NULL == video_ctx)
+	/* 
+	 * Create RK V4L2 Object on the least busy node, look it up by
+	 * name if none is probed.
+	 */
+	pixels = (int64_t)obj_context->picture_width
+		* obj_context->picture_height;
+	device = rk_place_context(rk_data, false, v4l2_codec_type, pixels);
+	video_ctx = rk_v4l2_dec_create(device ? device->path : NULL);
+	if (NULL == video_ctx) {
+		if (device)
+			rk_v4l2_device_release(&device->load, pixels);
 		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
+	if (device) {
+		rk_v4l2_set_device_load(video_ctx, &device->load, pixels);
+		video_ctx->raw_format = rk_v4l2_pick_raw_format(device);
+		rk_v4l2_set_max_requests(video_ctx, device->max_reqs);
+	}
 
 	video_ctx->input_size.w = obj_context->picture_width;
 	video_ctx->input_size.h = obj_context->picture_height;
+	video_ctx->bitstream_size = rk_dec_bitstream_size(obj_config->profile,
+			obj_context->picture_width,
+			obj_context->picture_height);
 
 	video_ctx->ops.set_codec(video_ctx, v4l2_codec_type);
 	video_ctx->ops.set_format(video_ctx, 0);
 
-	ret = video_ctx->ops.input_alloc(video_ctx, 1);
-	ASSERT_RET(0 != ret, VA_STATUS_ERROR_ALLOCATION_FAILED);
-
-	/* Keep Reference buffer */
-	ret = video_ctx->ops.output_alloc
-		(video_ctx, MAX_CAPTURE_BUFFERS);
-	ASSERT_RET(0 != ret, VA_STATUS_ERROR_ALLOCATION_FAILED);
-
-	/* There could be more common for stramon
-	 * Also why not qbuf first but not streamon */
-	for (uint8_t i = 0; i < ret; i++)
-		video_ctx->ops.qbuf_output(video_ctx,
-				&video_ctx->output_buffer[i]);
-
 	rk_v4l2_data->wrapper_pdrvctx = h264d_init();
 	if (NULL == rk_v4l2_data->wrapper_pdrvctx) {
 		rk_error_msg("vpu backend request wrapper failed\n");
 		rk_v4l2_destroy(video_ctx);
+		free(video_ctx);
 
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 	}
 
+	/* The references have to be in the surfaces of the application */
+	if (obj_context->num_render_targets > 1)
+		h264d_set_max_dpb_size(rk_v4l2_data->wrapper_pdrvctx,
+				obj_context->num_render_targets - 1);
+
+	/* Several pictures could be in the VPU at the same time */
+	ret = video_ctx->ops.input_alloc(video_ctx, DECODER_INPUT_BUFFERS);
+	ASSERT_RET(0 != ret, VA_STATUS_ERROR_ALLOCATION_FAILED);
+
 	rk_v4l2_data->v4l2_ctx = video_ctx;
 
+#ifdef DECODER_COMPLETION_THREAD
+	/* vaSyncSurface() would only wait for the thread to signal */
+	if (!rk_v4l2_start_completion(video_ctx))
+		rk_info_msg("the buffers are dequeued by the callers\n");
+#endif
+
+	/* A surface is queued when it is going to be decoded */
+	rk_v4l2_data->import_capture = rk_dec_import_capture(ctx,
+			rk_v4l2_data, obj_context);
+	if (rk_v4l2_data->import_capture)
+		return VA_STATUS_SUCCESS;
+
+	/* Keep Reference buffer, it is resized when the SPS comes */
+	ret = video_ctx->ops.output_alloc(video_ctx,
+			rk_dec_capture_count(rk_v4l2_data,
+			h264d_get_dpb_size(rk_v4l2_data->wrapper_pdrvctx,
+				obj_context->picture_width,
+				obj_context->picture_height)));
+	ASSERT_RET(0 != ret, VA_STATUS_ERROR_ALLOCATION_FAILED);
+
+	/* There could be more common for stramon
+	 * Also why not qbuf first but not streamon */
+	rk_dec_setup_captures(rk_v4l2_data);
+
 	return VA_STATUS_SUCCESS;
 }
 
@@ -401,8 +1315,24 @@ decoder_v4l2_destroy_context(void *hw_ctx)
 	if (NULL == rk_v4l2_ctx)
 		return;
 
+	/* The pictures in the VPU land in their surfaces first */
+	if (rk_v4l2_ctx->va_ctx)
+		while (rk_dec_retire_job(rk_v4l2_ctx->va_ctx, rk_v4l2_ctx));
+	rk_dec_drop_pending(rk_v4l2_ctx);
+	if (rk_v4l2_ctx->v4l2_ctx) {
+		/* The surfaces outlive the context */
+		if (rk_v4l2_ctx->va_ctx)
+			rk_dec_migrate_surfaces(rk_v4l2_ctx->va_ctx,
+					rk_v4l2_ctx);
+		rk_dec_detach_captures(rk_v4l2_ctx);
+	}
+
 	h264d_deinit(rk_v4l2_ctx->wrapper_pdrvctx);
 
+	/* 
+	 * The slice data buffers and the pictures the application still
+	 * holds keep their V4L2 buffers.
+	 */
 	rk_v4l2_destroy(rk_v4l2_ctx->v4l2_ctx);
 	free(rk_v4l2_ctx->v4l2_ctx);
 }
@@ -417,11 +1347,25 @@ decoder_v4l2_create_context()
 		return NULL;
 
 	memset(rk_v4l2_ctx, 0, sizeof(*rk_v4l2_ctx));
+	for (uint32_t r = 0; r <= RK_V4L2_MAX_REQUESTS; r++) {
+		struct rk_dec_ctrl_cache *cache = rk_v4l2_ctx->ctrl_cache[r];
+
+		cache[0].id = V4L2_CID_MPEG_VIDEO_H264_SPS;
+		cache[1].id = V4L2_CID_MPEG_VIDEO_H264_PPS;
+		cache[2].id = V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX;
+	}
 
 	rk_v4l2_ctx->base.run = rk_dec_v4l2_decode_picture;
 	rk_v4l2_ctx->base.destroy = decoder_v4l2_destroy_context;
-	rk_v4l2_ctx->base.get_status = NULL;
-	rk_v4l2_ctx->base.sync = NULL;
+	rk_v4l2_ctx->base.get_status = rk_dec_v4l2_get_status;
+	rk_v4l2_ctx->base.sync = rk_dec_v4l2_sync;
+	rk_v4l2_ctx->base.alloc_buffer = rk_dec_v4l2_alloc_buffer;
+#ifdef DECODER_ASYNC
+	rk_v4l2_ctx->async = true;
+#endif
+#ifdef DECODER_FRAME_MODE
+	rk_v4l2_ctx->frame_mode = true;
+#endif
 
 	return (struct hw_context *) rk_v4l2_ctx;
 }
@@ -30,11 +30,75 @@
 #include "rockchip_backend.h"
 #include "v4l2_utils.h"
 
+#define RK_DEC_MAX_PENDING_JOBS		16
+/* The controls the parser gives for a request */
+#define RK_DEC_MAX_CTRLS		5
+#define RK_DEC_NUM_CACHED_CTRLS		3
+
+/* The payload last set of a control which rarely changes */
+struct rk_dec_ctrl_cache {
+	uint32_t id;
+	uint32_t size;
+	bool valid;
+	union {
+		struct v4l2_ctrl_h264_sps sps;
+		struct v4l2_ctrl_h264_pps pps;
+		struct v4l2_ctrl_h264_scaling_matrix scaling_matrix;
+	} payload;
+};
+
+/* A bitstream buffer queued to the VPU whose result is not collected */
+struct rk_dec_v4l2_job {
+	VASurfaceID surface;
+	struct rk_v4l2_buffer *inbuf;
+	/* The CAPTURE buffer the VPU would write */
+	int32_t capture_index;
+};
+
 struct rk_dec_v4l2_context {
 	struct hw_context base;
+	/* The driver and the VA context it decodes for */
+	VADriverContextP va_ctx;
+	VAContextID context_id;
 	struct rk_v4l2_object *v4l2_ctx;
 	void *wrapper_pdrvctx;
 	int32_t profile;
+	/* Don't wait for the hardware in vaEndPicture() */
+	bool async;
+	/* Submit all the slices of a picture at once */
+	bool frame_mode;
+	/* The bitstream buffer is being filled with slices */
+	struct rk_v4l2_buffer *pending_inbuf;
+	/* Ring of the submitted jobs, in the order they were queued */
+	struct rk_dec_v4l2_job jobs[RK_DEC_MAX_PENDING_JOBS];
+	uint32_t job_head;
+	uint32_t num_jobs;
+	/* 
+	 * The CAPTURE buffers in the driver queue, the VPU takes
+	 * them in this order, which lets us know the output buffer
+	 * of a job before it is done.
+	 */
+	int32_t capture_queue[VIDEO_MAX_FRAME];
+	uint32_t capture_head;
+	uint32_t num_queued_captures;
+	/* The CAPTURE buffers the DPB of the parser has a reference on */
+	bool dpb_ref[VIDEO_MAX_FRAME];
+	/* 
+	 * The CAPTURE buffers are the memory of the render targets,
+	 * a surface is always decoded into the buffer of its slot.
+	 */
+	bool import_capture;
+	VASurfaceID capture_surfaces[VIDEO_MAX_FRAME];
+	uint32_t num_capture_surfaces;
+	/* The controls of a request, only those changed are set */
+	struct v4l2_ext_control ctrls[RK_DEC_MAX_CTRLS];
+	/* 
+	 * Row 0 is the last submitted, the others what was last set
+	 * through each request ID, which the ID still holds when it
+	 * is allocated again.
+	 */
+	struct rk_dec_ctrl_cache
+		ctrl_cache[RK_V4L2_MAX_REQUESTS + 1][RK_DEC_NUM_CACHED_CTRLS];
 };
 
 struct hw_context *decoder_v4l2_create_context();
@@ -24,9 +24,12 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <va/va.h>
 #include "common.h"
 #include "rockchip_device_info.h"
+#include "rockchip_debug.h"
 
 /* Extra set of chroma formats supported for H.264 decoding (beyond YUV 4:2:0) */
 #define EXTRA_H264_DEC_CHROMA_FORMATS \
@@ -135,3 +138,92 @@ struct hw_codec_info *rk_get_codec_info(int devid)
 		return NULL;
 	}
 }
+
+struct hw_codec_info *
+rk_probe_codec_info(int devid, struct hw_codec_info *info,
+		const struct rk_v4l2_device_info *devices, int32_t num_devices)
+{
+	struct hw_codec_info *defaults = rk_get_codec_info(devid);
+	const struct rk_v4l2_device_info *device;
+	int max_width = 0, max_height = 0;
+
+	if (NULL == defaults)
+		return NULL;
+	/* No sysfs or no VPU driver loaded yet, trust the table */
+	if (0 == num_devices)
+		return defaults;
+
+	*info = *defaults;
+
+	device = rk_v4l2_find_device(devices, num_devices, false,
+			V4L2_PIX_FMT_H264_SLICE);
+	info->has_h264_decoding = NULL != device && device->has_codec_controls;
+	device = rk_v4l2_find_device(devices, num_devices, true,
+			V4L2_PIX_FMT_JPEG);
+	info->has_jpeg_encoding = NULL != device && device->has_codec_controls;
+
+	for (int32_t i = 0; i < num_devices; i++) {
+		if (devices[i].max_width > max_width)
+			max_width = devices[i].max_width;
+		if (devices[i].max_height > max_height)
+			max_height = devices[i].max_height;
+	}
+	if (max_width && max_height) {
+		info->max_width = max_width;
+		info->max_height = max_height;
+	}
+
+	return info;
+}
+
+int32_t
+rk_vpu_pin_policy(struct rockchip_driver_data *rk_data, bool is_encoder,
+		uint32_t coded_format)
+{
+	const char *path = getenv("ROCKCHIP_VPU_DEVICE");
+	struct rk_v4l2_device_info *device;
+
+	if (NULL == path)
+		return -1;
+
+	for (int32_t i = 0; i < rk_data->num_vpu_devices; i++) {
+		device = &rk_data->vpu_devices[i];
+		if (strcmp(device->path, path) || device->is_encoder
+			!= is_encoder)
+			continue;
+		if (rk_v4l2_device_has_format(device, coded_format))
+			return i;
+	}
+
+	return -1;
+}
+
+struct rk_v4l2_device_info *
+rk_place_context(struct rockchip_driver_data *rk_data, bool is_encoder,
+		uint32_t coded_format, int64_t pixels)
+{
+	struct rk_v4l2_device_info *device;
+	int32_t index = -1;
+
+	pthread_mutex_lock(&rk_data->vpu_lock);
+	if (rk_data->vpu_policy)
+		index = rk_data->vpu_policy(rk_data, is_encoder, coded_format);
+	if (index < 0 || index >= rk_data->num_vpu_devices)
+		index = rk_v4l2_select_device(rk_data->vpu_devices,
+				rk_data->num_vpu_devices, is_encoder,
+				coded_format);
+	if (index < 0) {
+		pthread_mutex_unlock(&rk_data->vpu_lock);
+		return NULL;
+	}
+
+	device = &rk_data->vpu_devices[index];
+	rk_v4l2_device_reserve(&device->load, pixels);
+	pthread_mutex_unlock(&rk_data->vpu_lock);
+
+	rk_info_msg("context of %lld pixels on %s, %d contexts there\n",
+			(long long)pixels, device->path,
+			device->load.num_contexts);
+
+	return device;
+}
@@ -27,8 +27,30 @@
 #ifndef _ROCKCHIP_DEVICE_INFO_H_
 #define _ROCKCHIP_DEVICE_INFO_H_
 #include "rockchip_backend.h"
+#include "v4l2_utils.h"
 
 struct hw_codec_info *
 rk_get_codec_info(int devid);
 
+/* 
+ * The codec info of the VPU nodes found, what can't be queried comes
+ * from the table of devid. NULL if devid is unknown.
+ */
+struct hw_codec_info *
+rk_probe_codec_info(int devid, struct hw_codec_info *info,
+		const struct rk_v4l2_device_info *devices, int32_t num_devices);
+
+/* ROCKCHIP_VPU_DEVICE=/dev/videoN pins the contexts it could serve */
+int32_t
+rk_vpu_pin_policy(struct rockchip_driver_data *rk_data, bool is_encoder,
+		uint32_t coded_format);
+
+/* 
+ * Choose the node of a new context and reserve the load of pixels on
+ * it, NULL if no node is probed for the codec.
+ */
+struct rk_v4l2_device_info *
+rk_place_context(struct rockchip_driver_data *rk_data, bool is_encoder,
+		uint32_t coded_format, int64_t pixels);
+
 #endif
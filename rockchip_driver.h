@@ -37,6 +37,7 @@
 #include "rockchip_codec_info.h"
 #include "rockchip_fourcc.h"
 #include "v4l2_memory.h"
+#include "v4l2_utils.h"
 
 #define ROCKCHIP_MAX_PROFILES			18
 #define ROCKCHIP_MAX_ENTRYPOINTS		2
@@ -69,11 +70,25 @@ struct rockchip_driver_data {
 	struct object_heap buffer_heap;
 	struct object_heap image_heap;
 	struct hw_codec_info *codec_info;
+	/* The VPU nodes found at init, the codec_info is filled from them */
+	struct rk_v4l2_device_info vpu_devices[RK_V4L2_MAX_DEVICES];
+	int32_t num_vpu_devices;
+	struct hw_codec_info *probed_codec_info;
+	/* 
+	 * Pins a new context to one of the vpu_devices, -1 lets the
+	 * load of them decide.
+	 */
+	int32_t (*vpu_policy) (struct rockchip_driver_data *rk_data,
+			bool is_encoder, uint32_t coded_format);
+	/* The placement of a context and its reservation are one step */
+	pthread_mutex_t vpu_lock;
 
 	char va_vendor[256];
 
 	VADisplayAttribute *display_attributes;
 	VAContextID current_context_id;
+	/* The surface memory is allocated from it, -1 if no DRM */
+	int32_t drm_fd;
 
 	union {
 		void *x11_backend;
@@ -108,6 +123,8 @@ struct object_context {
 	union codec_state codec_state;
 	/* this structure would be defined at rockchip_backend.h */
 	struct hw_context *hw_context;
+	/* Where the buffers of the context are recycled */
+	struct rk_buffer_pool *buffer_pool;
 };
 
 #define SURFACE_REFERENCED      (1 << 0)
@@ -127,6 +144,12 @@ struct object_surface {
 	int fourcc;
 
 	struct rk_v4l2_buffer *bo;
+	/* The memory of the surface, the decoder writes to it directly */
+	struct rk_v4l2_buffer *own_bo;
+	/* The memory is the caller's dma-bufs, its layout is kept */
+	bool external;
+	/* The context last decoding it, VA_INVALID_ID if none */
+	VAContextID context_id;
 	int32_t size;
 	VAImageID locked_image_id;
 	VAImageID derived_image_id;
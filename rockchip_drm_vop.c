@@ -283,10 +283,12 @@ VAStatus rockchip_drm_vop_put_surface (
 	VADriverContextP ctx = dpy;
 	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
 	struct object_surface *obj_surface = SURFACE(surface);
-	uint32_t handle, handles[4], pitches[4], offsets[4] = {0}; /* we only use [0] */
+	uint32_t handles[4], pitches[4], offsets[4] = {0}; /* we only use [0] */
 	int32_t drm_format, ret, fb_id;
 	struct drm_output *drm_output = rk_data->drm_output;
 	static int32_t last_fb_id = 0;
+	/* Being scanned out, it can't be decoded into */
+	static struct rk_v4l2_buffer *last_bo = NULL;
 #if 1
 	drmModeCrtcPtr c;
 #endif
@@ -308,21 +310,24 @@ VAStatus rockchip_drm_vop_put_surface (
 						&drm_output->drm_planes[i];
 			}
 		}
-		ret = drmPrimeFDToHandle(drm_output->fd,
-				obj_surface->bo->plane[0].dma_fd,
-				&handle);
-		if (ret < 0) {
-			rk_error_msg("can't create fb handle %s\n",
-					strerror(ret));
-			return VA_STATUS_ERROR_OPERATION_FAILED;
+		if (obj_surface->bo->num_components != 2)
+			return VA_STATUS_ERROR_INVALID_SURFACE;
+
+		/* The chroma may be in a dma-buf of its own */
+		for (uint32_t i = 0; i < 2; i++) {
+			struct rk_v4l2_buffer *bo = obj_surface->bo;
+
+			ret = drmPrimeFDToHandle(drm_output->fd,
+				bo->plane[bo->component[i].plane].dma_fd,
+				&handles[i]);
+			if (ret < 0) {
+				rk_error_msg("can't create fb handle %s\n",
+						strerror(ret));
+				return VA_STATUS_ERROR_OPERATION_FAILED;
+			}
+			pitches[i] = bo->component[i].pitch;
+			offsets[i] = bo->component[i].offset;
 		}
-
-		pitches[0] = obj_surface->width;
-		offsets[0] = 0;
-		handles[0] = handle;
-		pitches[1] = obj_surface->width;
-		offsets[1] = obj_surface->width * obj_surface->height;
-		handles[1] = handle;
 		break;
 	default:
 		return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
@@ -363,6 +368,9 @@ VAStatus rockchip_drm_vop_put_surface (
 		drmModeRmFB(drm_output->ctrl_fd, last_fb_id);
 	}
 	last_fb_id = fb_id;
+	v4l2_bo_reference(obj_surface->bo);
+	v4l2_bo_unreference(last_bo);
+	last_bo = obj_surface->bo;
 #if 1
 	drmModeFreeCrtc(c);
 #endif
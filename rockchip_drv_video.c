@@ -25,8 +25,13 @@
  */
 
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <va/va.h>
 #include <va/va_backend.h>
+#if VA_CHECK_VERSION(1,1,0)
+#include <va/va_drmcommon.h>
+#endif
 
 #include "config.h"
 #include "rockchip_driver.h"
@@ -41,6 +46,8 @@
 #include "rockchip_drm_vop.h"
 #endif
 
+#define DRM_DEVICE_PATH			"/dev/dri/card0"
+
 #define CONFIG_ID_OFFSET		0x01000000
 #define CONTEXT_ID_OFFSET		0x02000000
 #define SURFACE_ID_OFFSET		0x04000000
@@ -508,6 +515,97 @@ static VAStatus rockchip_QueryConfigAttributes(
     return vaStatus;
 }
 
+/* 
+ * Wrap the NV12 picture the caller describes, a component could be in
+ * any of the dma-bufs as long as it fits.
+ */
+static struct rk_v4l2_buffer *
+rockchip_import_surface(uint32_t memory_type, void *descriptor,
+		uint32_t index, uint32_t width, uint32_t height)
+{
+	int32_t fds[RK_VIDEO_MAX_PLANES];
+	uint32_t sizes[RK_VIDEO_MAX_PLANES];
+	uint32_t planes[2], offsets[2], pitches[2];
+	uint32_t num_fds = 0, num_components = 0;
+	struct rk_v4l2_buffer *bo;
+
+	if (VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME == memory_type) {
+		VASurfaceAttribExternalBuffers *ext = descriptor;
+
+		if (VA_FOURCC_NV12 != ext->pixel_format
+			|| 2 != ext->num_planes || NULL == ext->buffers)
+			return NULL;
+
+		/* A buffer each surface */
+		fds[0] = ext->buffers[index];
+		sizes[0] = ext->data_size;
+		num_fds = 1;
+		for (; num_components < 2; num_components++) {
+			planes[num_components] = 0;
+			offsets[num_components] = ext->offsets[num_components];
+			pitches[num_components] = ext->pitches[num_components];
+		}
+	}
+#if VA_CHECK_VERSION(1,1,0)
+	else if (VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2 == memory_type) {
+		VADRMPRIMESurfaceDescriptor *desc = descriptor;
+
+		if (VA_FOURCC_NV12 != desc->fourcc || 0 == desc->num_objects
+			|| desc->num_objects > RK_VIDEO_MAX_PLANES)
+			return NULL;
+
+		for (; num_fds < desc->num_objects; num_fds++) {
+			/* The VPU only knows the linear pictures */
+			if (RK_DRM_FORMAT_MOD_LINEAR !=
+				desc->objects[num_fds].drm_format_modifier)
+				return NULL;
+			fds[num_fds] = desc->objects[num_fds].fd;
+			sizes[num_fds] = desc->objects[num_fds].size;
+		}
+
+		/* A NV12 layer, or a R8 and a GR88 layer */
+		for (uint32_t l = 0; l < desc->num_layers && l < 4; l++) {
+			for (uint32_t p = 0; p < desc->layers[l].num_planes
+					&& p < 4; p++) {
+				if (num_components >= 2)
+					return NULL;
+				planes[num_components] =
+					desc->layers[l].object_index[p];
+				offsets[num_components] =
+					desc->layers[l].offset[p];
+				pitches[num_components] =
+					desc->layers[l].pitch[p];
+				num_components++;
+			}
+		}
+	}
+#endif
+	if (2 != num_components)
+		return NULL;
+
+	bo = v4l2_bo_import_dmabuf(fds, sizes, num_fds);
+	if (NULL == bo)
+		return NULL;
+
+	bo->num_components = 2;
+	for (uint32_t i = 0; i < 2; i++) {
+		uint32_t lines = i ? (height + 1) / 2 : height;
+
+		if (planes[i] >= bo->length || pitches[i] < width
+			|| offsets[i] + (uint64_t)pitches[i] * lines
+			> bo->plane[planes[i]].length) {
+			rk_error_msg("component %u is out of its dma-buf\n", i);
+			v4l2_bo_free(bo);
+			return NULL;
+		}
+		bo->component[i].plane = planes[i];
+		bo->component[i].offset = offsets[i];
+		bo->component[i].pitch = pitches[i];
+	}
+
+	return bo;
+}
+
 static VAStatus rockchip_CreateSurfaces2(
 		VADriverContextP ctx,
 		uint32_t format,
@@ -521,7 +619,8 @@ static VAStatus rockchip_CreateSurfaces2(
 {
 	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
 
-	VASurfaceAttribExternalBuffers *memory_attibute = NULL;
+	uint32_t memory_type = VA_SURFACE_ATTRIB_MEM_TYPE_V4L2;
+	void *descriptor = NULL;
 	VAStatus va_status = VA_STATUS_SUCCESS;
 	int32_t i;
 
@@ -533,11 +632,17 @@ static VAStatus rockchip_CreateSurfaces2(
 					VAGenericValueTypeInteger,
 					VA_STATUS_ERROR_INVALID_PARAMETER);
 
-			/* Only support V4L2 buffer now */
-			if (attrib_list[j].value.value.i !=
-					VA_SURFACE_ATTRIB_MEM_TYPE_V4L2)
-
-				return VA_STATUS_ERROR_ALLOCATION_FAILED;
+			memory_type = attrib_list[j].value.value.i;
+			switch (memory_type) {
+			case VA_SURFACE_ATTRIB_MEM_TYPE_V4L2:
+			case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME:
+#if VA_CHECK_VERSION(1,1,0)
+			case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2:
+#endif
+				break;
+			default:
+				return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+			}
 		}
 
 		if ((attrib_list[j].type ==
@@ -547,9 +652,7 @@ static VAStatus rockchip_CreateSurfaces2(
 			ASSERT_RET(attrib_list[j].value.type ==
 					VAGenericValueTypePointer,
 					VA_STATUS_ERROR_INVALID_PARAMETER);
-			/* FIXME use this value or drop it */
-			memory_attibute = (VASurfaceAttribExternalBuffers *)
-				attrib_list[j].value.value.p;
+			descriptor = attrib_list[j].value.value.p;
 		}
 	}
 
@@ -559,6 +662,20 @@ static VAStatus rockchip_CreateSurfaces2(
 		return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
 	}
 
+	/* The memory of the surfaces is the caller's */
+	if (VA_SURFACE_ATTRIB_MEM_TYPE_V4L2 != memory_type) {
+		if (NULL == descriptor)
+			return VA_STATUS_ERROR_INVALID_PARAMETER;
+		if (VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME == memory_type
+			&& ((VASurfaceAttribExternalBuffers *)descriptor)
+			->num_buffers < num_surfaces)
+			return VA_STATUS_ERROR_INVALID_PARAMETER;
+		/* A descriptor is a surface */
+		if (VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME != memory_type
+			&& num_surfaces > 1)
+			return VA_STATUS_ERROR_INVALID_PARAMETER;
+	}
+
 	for (i = 0; i < num_surfaces; i++)
 	{
 		int32_t surfaceID = object_heap_allocate(&rk_data->surface_heap);
@@ -589,6 +706,35 @@ static VAStatus rockchip_CreateSurfaces2(
 		obj_surface->size = 0;
 		obj_surface->locked_image_id = VA_INVALID_ID;
 		obj_surface->derived_image_id = VA_INVALID_ID;
+		obj_surface->external = false;
+		obj_surface->context_id = VA_INVALID_ID;
+
+		if (VA_SURFACE_ATTRIB_MEM_TYPE_V4L2 != memory_type) {
+			obj_surface->own_bo = rockchip_import_surface
+				(memory_type, descriptor, i, width, height);
+			if (NULL == obj_surface->own_bo) {
+				object_heap_free(&rk_data->surface_heap,
+					(object_base_p) obj_surface);
+				surfaces[i] = VA_INVALID_SURFACE;
+				va_status = VA_STATUS_ERROR_INVALID_PARAMETER;
+				break;
+			}
+			obj_surface->external = true;
+			continue;
+		}
+
+		/* 
+		 * NV12 and the motion vectors the VPU stores after it,
+		 * the decoder would use the V4L2 buffers if it fails.
+		 */
+		obj_surface->own_bo = v4l2_bo_alloc_dumb(rk_data->drm_fd,
+			obj_surface->width * obj_surface->height * 3 / 2
+			+ (obj_surface->width / 16)
+			* (obj_surface->height / 16) * 64);
+		if (obj_surface->own_bo)
+			v4l2_bo_set_nv12_layout(obj_surface->own_bo,
+					obj_surface->width, obj_surface->width,
+					obj_surface->height);
 	}
 
 	/* Error recovery */
@@ -601,6 +747,7 @@ static VAStatus rockchip_CreateSurfaces2(
 				SURFACE(surfaces[i]);
 			surfaces[i] = VA_INVALID_SURFACE;
 			ASSERT(obj_surface);
+			v4l2_bo_free(obj_surface->own_bo);
 			object_heap_free(&rk_data->surface_heap,
 					(object_base_p) obj_surface);
 	    }
@@ -636,6 +783,7 @@ static VAStatus rockchip_DestroySurfaces(
         obj_surface = SURFACE(surface_list[i - 1]);
         ASSERT_RET(obj_surface, VA_STATUS_ERROR_INVALID_SURFACE);
 
+        v4l2_bo_free(obj_surface->own_bo);
         object_heap_free(&rk_data->surface_heap, (object_base_p) obj_surface);
     }
     return VA_STATUS_SUCCESS;
@@ -765,6 +913,35 @@ error:
 	return va_status;
 }
 
+/* The context whose job the surface may wait for */
+static struct object_context *
+rockchip_surface_context(VADriverContextP ctx,
+		struct object_surface *obj_surface)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
+	struct object_context *obj_context = NULL;
+
+	if (obj_surface && VA_INVALID_ID != obj_surface->context_id)
+		obj_context = CONTEXT(obj_surface->context_id);
+	if (NULL == obj_context)
+		obj_context = CONTEXT(rk_data->current_context_id);
+
+	return obj_context;
+}
+
+/* Wait for the pending hardware job writing to the surface */
+static void
+rockchip_surface_wait(VADriverContextP ctx, VASurfaceID surface)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
+	struct object_context *obj_context =
+		rockchip_surface_context(ctx, SURFACE(surface));
+
+	if (obj_context && obj_context->hw_context
+		&& obj_context->hw_context->sync)
+		obj_context->hw_context->sync(ctx, surface);
+}
+
 static VAStatus rockchip_DeriveImage(
 	VADriverContextP ctx,
 	VASurfaceID surface,
@@ -776,12 +953,13 @@ static VAStatus rockchip_DeriveImage(
 	struct object_surface *obj_surface;
 	VAImageID image_id;
 	VAStatus va_status = VA_STATUS_ERROR_OPERATION_FAILED;
-	uint32_t size, size2;
 
 	obj_surface = SURFACE(surface);
 	if (NULL == obj_surface)
 		return VA_STATUS_ERROR_INVALID_SURFACE;
 
+	rockchip_surface_wait(ctx, surface);
+
 	if (NULL == obj_surface->bo) {
 		va_status = rk_v4l2_assign_surface_bo(ctx, obj_surface);
 		if (va_status != VA_STATUS_SUCCESS)
@@ -816,17 +994,22 @@ static VAStatus rockchip_DeriveImage(
 	image->format.fourcc = obj_surface->fourcc;
 	image->format.byte_order = VA_LSB_FIRST;
 
-	size = obj_surface->width * obj_surface->height;
-	size2 = (obj_surface->width / 2) * (obj_surface->height / 2);
-
 	switch (image->format.fourcc) {
 	case VA_FOURCC_NV12:
+		/* An image is a single buffer, vaGetImage() works for NV12M */
+		if (obj_surface->bo->num_components != 2
+			|| obj_surface->bo->component[1].plane != 0)
+			goto error;
+
 		image->num_planes = 2;
-		image->pitches[0] = obj_surface->width;
-		image->offsets[0] = 0;
-		image->pitches[1] = obj_surface->width;
-		image->offsets[1] = obj_surface->width * obj_surface->height;
-		image->data_size  = size + 2 * size2;
+		for (uint32_t i = 0; i < image->num_planes; i++) {
+			image->pitches[i] =
+				obj_surface->bo->component[i].pitch;
+			image->offsets[i] =
+				obj_surface->bo->component[i].offset;
+		}
+		image->data_size = image->offsets[1] + image->pitches[1]
+			* (obj_surface->height / 2);
 		break;
 	default:
 		goto error;
@@ -959,8 +1142,6 @@ static VAStatus rockchip_GetImage(
 	VARectangle rect;
 	VAStatus va_status;
 	
-	struct object_context *obj_context = 
-		CONTEXT(rk_data->current_context_id);
 	struct object_surface * const obj_surface = SURFACE(surface);
 	struct object_image * const obj_image = IMAGE(image);
 
@@ -968,16 +1149,14 @@ static VAStatus rockchip_GetImage(
 	    return VA_STATUS_ERROR_INVALID_SURFACE;
 	if (!obj_image)
 	    return VA_STATUS_ERROR_INVALID_IMAGE;
+
+	/* The decoder may still be writing it */
+	rockchip_surface_wait(ctx, surface);
+
 	/* don't get anything, keep previous data */
 	if (!obj_surface->bo)
 	   return VA_STATUS_SUCCESS;
 
-	if(obj_context->hw_context->get_status) {
-        	if (VASurfaceReady != obj_context->hw_context->get_status
-				(ctx, surface))
-			return VA_STATUS_ERROR_SURFACE_BUSY;
-	}
-
 	/* image check */
 	if (x < 0 || y < 0)
 		return VA_STATUS_ERROR_INVALID_PARAMETER;
@@ -1193,6 +1372,7 @@ static VAStatus rockchip_CreateContext(
 	obj_context->render_targets = (VASurfaceID *) 
 		calloc(num_render_targets, sizeof(VASurfaceID));
 	obj_context->hw_context = NULL;
+	obj_context->buffer_pool = NULL;
 	obj_context->flags = flag;
 
 	if (obj_context->render_targets == NULL)
@@ -1292,6 +1472,9 @@ static VAStatus rockchip_CreateContext(
 			(ctx, obj_context);
 	}
 
+	/* It is fine without, the buffers are allocated each time then */
+	obj_context->buffer_pool = rockchip_buffer_pool_create();
+
 	rk_data->current_context_id = contextID;
 
 error:
@@ -1347,6 +1530,9 @@ static VAStatus rockchip_DestroyContext(
 	    free(obj_context->codec_state.decode.slice_datas);
     }
 
+    rockchip_buffer_pool_destroy(obj_context->buffer_pool);
+    obj_context->buffer_pool = NULL;
+
     obj_context->context_id = -1;
     obj_context->config_id = -1;
     obj_context->picture_width = 0;
@@ -1443,12 +1629,16 @@ static VAStatus rockchip_MapBuffer(
 	}
     
 	if (NULL != obj_buffer->buffer_store->bo) {
-		if (NULL == obj_buffer->buffer_store->bo->plane[0].data)
+		uint8_t *data = v4l2_bo_map(obj_buffer->buffer_store->bo, 0);
+
+		if (NULL == data) {
 			rk_error_msg("index: %d, used %d\n",
 					obj_buffer->buffer_store->bo->index,
 					obj_buffer->buffer_store->bo->plane[0].bytesused);
+			return VA_STATUS_ERROR_OPERATION_FAILED;
+		}
 
-		*pbuf = obj_buffer->buffer_store->bo->plane[0].data;
+		*pbuf = data + obj_buffer->buffer_store->offset;
 		va_status = VA_STATUS_SUCCESS;
 
 		/* FIXME support insert header directly */
@@ -1613,6 +1803,10 @@ static VAStatus rockchip_BeginPicture(
 	}
     /* Decoder */
     if (CODEC_DEC == obj_context->codec_type) {
+		/* The surface could still be in a previous decoding */
+		if (obj_context->hw_context && obj_context->hw_context->sync)
+			obj_context->hw_context->sync(ctx, render_target);
+
 		/* render_target */
 		obj_context->codec_state.decode.current_render_target = obj_surface->base.id;
 
@@ -1636,9 +1830,11 @@ static VAStatus rockchip_BeginPicture(
 
 		obj_context->codec_state.decode.num_slice_params = 0;
 		obj_context->codec_state.decode.num_slice_datas = 0;
+		/* Rewind the parameters, unless the app keeps some of them */
+		rockchip_buffer_pool_reset_arena(obj_context->buffer_pool);
 
 		/* You could do more hardware related cleanup or prepare here */
-		obj_surface->bo = NULL;
+		obj_surface->bo = obj_surface->own_bo;
     }
 
     return vaStatus;
@@ -1765,12 +1961,12 @@ static VAStatus rockchip_SyncSurface(
     struct object_context *obj_context;
     struct object_surface *obj_surface;
 
-    obj_context = CONTEXT(rk_data->current_context_id);
-    ASSERT(obj_context);
-
     obj_surface = SURFACE(render_target);
     ASSERT(obj_surface);
 
+    obj_context = rockchip_surface_context(ctx, obj_surface);
+    ASSERT(obj_context);
+
     if (obj_context->hw_context->sync)
 	    obj_context->hw_context->sync(ctx, render_target);
 
@@ -1789,12 +1985,12 @@ static VAStatus rockchip_QuerySurfaceStatus(
     struct object_context *obj_context;
     struct object_surface *obj_surface;
 
-    obj_context = CONTEXT(rk_data->current_context_id);
-    ASSERT(obj_context);
-
     obj_surface = SURFACE(render_target);
     ASSERT(obj_surface);
 
+    obj_context = rockchip_surface_context(ctx, obj_surface);
+    ASSERT(obj_context);
+
     rk_info_msg("rockchip_QuerySurfaceStatus %d\n", render_target);
     /* TODO */
     if (obj_context->hw_context->get_status)
@@ -1877,6 +2073,24 @@ rockchip_QuerySurfaceAttributes(VADriverContextP ctx,
 
 	if (NULL == attribs)
 		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+	/* The surfaces could wrap the dma-bufs of the caller */
+	attribs[i].type = VASurfaceAttribMemoryType;
+	attribs[i].value.type = VAGenericValueTypeInteger;
+	attribs[i].flags = VA_SURFACE_ATTRIB_GETTABLE
+		| VA_SURFACE_ATTRIB_SETTABLE;
+	attribs[i].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_V4L2
+		| VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+#if VA_CHECK_VERSION(1,1,0)
+	attribs[i].value.value.i |= VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
+#endif
+	i++;
+
+	attribs[i].type = VASurfaceAttribExternalBufferDescriptor;
+	attribs[i].value.type = VAGenericValueTypePointer;
+	attribs[i].flags = VA_SURFACE_ATTRIB_SETTABLE;
+	attribs[i].value.value.p = NULL;
+	i++;
 #if 0
 	attribs[i].type = VASurfaceAttribMaxWidth;
 	attribs[i].value.type = VAGenericValueTypeInteger;
@@ -2008,6 +2222,8 @@ rockchip_AcquireBufferHandle(VADriverContextP ctx, VABufferID buf_id,
 		obj_buffer->num_elements * obj_buffer->size_element;
 
 	obj_buffer->export_refcount++;
+	/* The external API could still use it after the image is gone */
+	v4l2_bo_reference(obj_buffer->buffer_store->bo);
 
 	*out_buf_info = obj_buffer->export_state;
 
@@ -2028,6 +2244,8 @@ rockchip_ReleaseBufferHandle(VADriverContextP ctx, VABufferID buf_id)
 	if (obj_buffer->export_refcount == 0)
 		return VA_STATUS_ERROR_INVALID_BUFFER;
 
+	v4l2_bo_unreference(obj_buffer->buffer_store->bo);
+
 	if (--obj_buffer->export_refcount == 0) {
 		VABufferInfo * const buf_info = &obj_buffer->export_state;
 
@@ -2038,6 +2256,99 @@ rockchip_ReleaseBufferHandle(VADriverContextP ctx, VABufferID buf_id)
 	return VA_STATUS_SUCCESS;
 }
 
+#if VA_CHECK_VERSION(1,1,0)
+/* The fds in the descriptor are the caller's, it has to close them */
+static VAStatus
+rockchip_ExportSurfaceHandle(VADriverContextP ctx, VASurfaceID surface,
+		uint32_t mem_type, uint32_t flags, void *descriptor)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
+	struct object_surface *obj_surface = SURFACE(surface);
+	VADRMPRIMESurfaceDescriptor *desc = descriptor;
+	struct rk_v4l2_buffer *bo;
+	uint32_t object[RK_VIDEO_MAX_PLANES];
+
+	if (NULL == obj_surface)
+		return VA_STATUS_ERROR_INVALID_SURFACE;
+	if (VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2 != mem_type)
+		return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+	if (!(flags & (VA_EXPORT_SURFACE_SEPARATE_LAYERS
+			| VA_EXPORT_SURFACE_COMPOSED_LAYERS)))
+		return VA_STATUS_ERROR_INVALID_PARAMETER;
+	if (VA_FOURCC_NV12 != obj_surface->fourcc)
+		return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+
+	/* The decoder writes the pictures of the surface there */
+	bo = obj_surface->own_bo;
+	if (NULL == bo || bo->num_components != 2)
+		return VA_STATUS_ERROR_UNIMPLEMENTED;
+	if (obj_surface->bo && obj_surface->bo != bo) {
+		rk_error_msg("the pictures of surface %d are not its own\n",
+				surface);
+		return VA_STATUS_ERROR_UNIMPLEMENTED;
+	}
+
+	memset(desc, 0, sizeof(*desc));
+	desc->fourcc = obj_surface->fourcc;
+	desc->width = obj_surface->orig_width;
+	desc->height = obj_surface->orig_height;
+
+	/* A DRM object for each memory plane */
+	for (uint32_t i = 0; i < bo->num_components; i++) {
+		uint32_t plane = bo->component[i].plane;
+		uint32_t j;
+
+		for (j = 0; j < desc->num_objects; j++) {
+			if (bo->plane[plane].dma_fd == desc->objects[j].fd)
+				break;
+		}
+		object[i] = j;
+		if (j < desc->num_objects)
+			continue;
+
+		desc->objects[j].fd = bo->plane[plane].dma_fd;
+		desc->objects[j].size = bo->plane[plane].length;
+		desc->objects[j].drm_format_modifier =
+			RK_DRM_FORMAT_MOD_LINEAR;
+		desc->num_objects++;
+	}
+
+	if (flags & VA_EXPORT_SURFACE_COMPOSED_LAYERS) {
+		desc->num_layers = 1;
+		desc->layers[0].drm_format = RK_DRM_FORMAT_NV12;
+		desc->layers[0].num_planes = bo->num_components;
+		for (uint32_t i = 0; i < bo->num_components; i++) {
+			desc->layers[0].object_index[i] = object[i];
+			desc->layers[0].offset[i] = bo->component[i].offset;
+			desc->layers[0].pitch[i] = bo->component[i].pitch;
+		}
+	}
+	else {
+		desc->num_layers = bo->num_components;
+		for (uint32_t i = 0; i < bo->num_components; i++) {
+			desc->layers[i].drm_format = i ?
+				RK_DRM_FORMAT_GR88 : RK_DRM_FORMAT_R8;
+			desc->layers[i].num_planes = 1;
+			desc->layers[i].object_index[0] = object[i];
+			desc->layers[i].offset[0] = bo->component[i].offset;
+			desc->layers[i].pitch[0] = bo->component[i].pitch;
+		}
+	}
+
+	for (uint32_t i = 0; i < desc->num_objects; i++) {
+		desc->objects[i].fd = fcntl(desc->objects[i].fd,
+				F_DUPFD_CLOEXEC, 0);
+		if (desc->objects[i].fd < 0) {
+			while (i--)
+				close(desc->objects[i].fd);
+			return VA_STATUS_ERROR_OPERATION_FAILED;
+		}
+	}
+
+	return VA_STATUS_SUCCESS;
+}
+#endif
+
 static VAStatus rockchip_LockSurface(
 		VADriverContextP ctx,
 		VASurfaceID surface,
@@ -2070,6 +2381,7 @@ static void rockchip_driver_data_terminate(VADriverContextP ctx)
     struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
     struct object_buffer *obj_buffer;
     struct object_config *obj_config;
+    struct object_surface *obj_surface;
     object_heap_iterator iter;
 
     /* Clean up left over buffers */
@@ -2085,7 +2397,16 @@ static void rockchip_driver_data_terminate(VADriverContextP ctx)
     }
     object_heap_destroy(&rk_data->buffer_heap);
 
-    /* TODO cleanup */
+    obj_surface = (struct object_surface *)
+	    object_heap_first(&rk_data->surface_heap, &iter);
+    while (obj_surface)
+    {
+        v4l2_bo_free(obj_surface->own_bo);
+        object_heap_free
+		(&rk_data->surface_heap, (struct object_base *)obj_surface);
+        obj_surface = (struct object_surface *)
+		object_heap_next(&rk_data->surface_heap, &iter);
+    }
     object_heap_destroy(&rk_data->surface_heap);
 
     /* TODO cleanup */
@@ -2103,6 +2424,15 @@ static void rockchip_driver_data_terminate(VADriverContextP ctx)
     }
     object_heap_destroy(&rk_data->config_heap);
 
+    if (rk_data->drm_fd >= 0)
+        close(rk_data->drm_fd);
+    rk_data->drm_fd = -1;
+
+    pthread_mutex_destroy(&rk_data->vpu_lock);
+    rk_data->codec_info = NULL;
+    free(rk_data->probed_codec_info);
+    rk_data->probed_codec_info = NULL;
+
     return VA_STATUS_SUCCESS;
 }
 
@@ -2111,11 +2441,31 @@ rockchip_driver_data_init(VADriverContextP ctx)
 {
 	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
 
-	/* FIXME using device id instead */
-	rk_data->codec_info = rk_get_codec_info(3288);
+	/* Look at the VPU once, the contexts use what is found here */
+	rk_data->num_vpu_devices = rk_v4l2_probe_devices(rk_data->vpu_devices,
+			RK_V4L2_MAX_DEVICES);
+	rk_data->vpu_policy = rk_vpu_pin_policy;
+	rk_data->probed_codec_info =
+		calloc(1, sizeof(*rk_data->probed_codec_info));
+	if (NULL == rk_data->probed_codec_info)
+		return false;
+	/* FIXME the defaults of the SoC, using device id instead */
+	rk_data->codec_info = rk_probe_codec_info(3288,
+			rk_data->probed_codec_info, rk_data->vpu_devices,
+			rk_data->num_vpu_devices);
 
 	if (NULL == rk_data->codec_info)
-		return false;
+		goto err_codec_info;
+
+	rk_data->drm_fd = -1;
+#ifdef HAVE_LIBDRM
+	rk_data->drm_fd = open(DRM_DEVICE_PATH, O_RDWR | O_CLOEXEC);
+	if (rk_data->drm_fd < 0)
+		rk_info_msg("Failed to open %s, the surfaces have no memory\n",
+				DRM_DEVICE_PATH);
+#endif
+
+	pthread_mutex_init(&rk_data->vpu_lock, NULL);
 
 	if (object_heap_init(&rk_data->config_heap, 
 		sizeof(struct object_config), CONFIG_ID_OFFSET))
@@ -2148,6 +2498,13 @@ err_surface_heap:
 err_context_heap:
 	object_heap_destroy(&rk_data->config_heap);
 err_config_heap:
+	pthread_mutex_destroy(&rk_data->vpu_lock);
+	if (rk_data->drm_fd >= 0)
+		close(rk_data->drm_fd);
+	rk_data->drm_fd = -1;
+err_codec_info:
+	free(rk_data->probed_codec_info);
+	rk_data->probed_codec_info = NULL;
 
 	return false;
 }
@@ -2306,6 +2663,9 @@ VAStatus VA_DRIVER_INIT_FUNC(  VADriverContextP ctx )
     vtable->vaAcquireBufferHandle = rockchip_AcquireBufferHandle;
     vtable->vaReleaseBufferHandle = rockchip_ReleaseBufferHandle;
 #endif
+#if VA_CHECK_VERSION(1,1,0)
+    vtable->vaExportSurfaceHandle = rockchip_ExportSurfaceHandle;
+#endif
 
     rk_data = (struct rockchip_driver_data *) malloc(sizeof(*rk_data) );
     if (NULL == rk_data) {
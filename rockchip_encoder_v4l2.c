@@ -33,6 +33,7 @@
 #include <va/va.h>
 #include <va/va_backend.h>
 #include "rockchip_driver.h"
+#include "rockchip_device_info.h"
 #include "rockchip_debug.h"
 #include "rockchip_encoder_v4l2.h"
 #include "v4l2_utils.h"
@@ -110,19 +111,53 @@ get_v4l2_codec(VAProfile profile)
 	return 0;
 }
 
-static void
+static bool
 rk_enc_prepare_buffer
 (VADriverContextP ctx, struct encode_state *encode_state, 
  struct rk_enc_v4l2_context * encode_context)
 {
+	struct object_surface *obj_surface = encode_state->input_yuv_object;
+	struct rk_v4l2_buffer *inbuf;
+
+	if (!encode_context->import_input) {
+		/* The picture is copied from the memory of the caller */
+		if (obj_surface->external) {
+			inbuf = rk_v4l2_acquire_input_buffer
+				(encode_context->v4l2_ctx, 0);
+			if (NULL == inbuf)
+				return false;
+			if (!v4l2_bo_copy_nv12(inbuf, obj_surface->own_bo,
+					obj_surface->orig_width,
+					obj_surface->orig_height)) {
+				rk_v4l2_put_input_buffer
+					(encode_context->v4l2_ctx, inbuf);
+				return false;
+			}
+			encode_context->inbuf = inbuf;
+			return true;
+		}
+
+		encode_context->inbuf = obj_surface->bo;
+		return NULL != obj_surface->bo;
+	}
+
+	if (NULL == obj_surface->own_bo)
+		return false;
+
+	inbuf = rk_v4l2_acquire_input_buffer(encode_context->v4l2_ctx, 0);
+	if (NULL == inbuf)
+		return false;
+	rk_v4l2_buffer_attach(inbuf, obj_surface->own_bo);
+	encode_context->inbuf = inbuf;
+
+	return true;
 }
 
-static void
+static bool
 rk_enc_jpeg_format_qual
 (VADriverContextP ctx, struct encode_state *encode_state, 
  struct rk_enc_v4l2_context * encode_context)
 {
-	struct object_surface *obj_surface;
 	VAEncPictureParameterBufferJPEG *pic_param;
 	VAQMatrixBufferJPEG *qmatrix;
 	VAEncPackedHeaderParameterBuffer *param = NULL;
@@ -137,8 +172,7 @@ rk_enc_jpeg_format_qual
 		encode_state->pic_param_ext->buffer;
 	quality = pic_param->quality;
     
-	obj_surface = encode_state->input_yuv_object;
-	inbuf = obj_surface->bo;
+	inbuf = encode_context->inbuf;
 
 	/* Never use the applicant send quantization tables */
 
@@ -166,7 +200,7 @@ rk_enc_jpeg_format_qual
 	 */
 	v4l2_qmatrix = malloc(sizeof(*v4l2_qmatrix));
 	if (NULL == v4l2_qmatrix)
-		return;
+		return false;
 
 	for (uint8_t i = 0; i < 64; i++) {
 		temp = (jpeg_luma_quant[zigzag_direct[i]] * quality) / 100;
@@ -186,11 +220,21 @@ rk_enc_jpeg_format_qual
 		(*encode_state->packed_header_params_ext)->buffer;
 	length_bytes = param->bit_length / 8;
 
+	/* The frame is not submitted without its own controls */
+	if (0 == rk_v4l2_request_alloc(encode_context->v4l2_ctx, inbuf)) {
+		rk_error_msg("no request left for the frame\n");
+		free(v4l2_qmatrix);
+		return false;
+	}
+
+	memset(&ext_ctrls, 0, sizeof(ext_ctrls));
 	ext_ctrls.count = 2;
+	ext_ctrls.request = inbuf->request;
 	ext_ctrls.controls = calloc(2, sizeof(struct v4l2_ext_control));
-	ext_ctrls.request = inbuf->index;
-	if (NULL == ext_ctrls.controls)
-		return;
+	if (NULL == ext_ctrls.controls) {
+		free(v4l2_qmatrix);
+		return false;
+	}
 
 	ext_ctrls.controls[0].id = V4L2_CID_JPEG_QMATRIX;
 	ext_ctrls.controls[0].ptr = v4l2_qmatrix;
@@ -200,11 +244,13 @@ rk_enc_jpeg_format_qual
 	ext_ctrls.controls[1].size = sizeof(uint32_t *);
 
 	/* Set codec parameters need by VPU */
-	ioctl(encode_context->v4l2_ctx->video_fd, 
+	rk_v4l2_ioctl(encode_context->v4l2_ctx->video_fd, 
 			VIDIOC_S_EXT_CTRLS, &ext_ctrls);
 
 	free(ext_ctrls.controls);
 	free(v4l2_qmatrix);
+
+	return true;
 }
 
 static void
@@ -214,7 +260,6 @@ rk_enc_push_buffer
 {
 	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
 
-	struct object_surface *obj_surface;
 	struct object_buffer *obj_buffer;
 	struct rk_v4l2_buffer *inbuf, *outbuf;
 	VAQMatrixBufferJPEG *qmatrix;
@@ -222,15 +267,17 @@ rk_enc_push_buffer
 	VAEncPackedHeaderParameterBuffer *param = NULL;
 	uint8_t *header_data = (uint8_t *)
 		(*encode_state->packed_header_data_ext)->buffer;
+	struct v4l2_pix_format_mplane *pix_mp;
 	uint32_t length_in_bits;
 	void *jpeg_hdr_ctx;
 	uint8_t *qtables[2];
 
 	/* input YUV surface */
-	obj_surface = encode_state->input_yuv_object;
-	inbuf = obj_surface->bo;
-	/* FIXME correct the byteused for each plane */
-	inbuf->plane[0].bytesused = obj_surface->size;
+	inbuf = encode_context->inbuf;
+	/* A whole picture in the planes of the format */
+	pix_mp = &encode_context->v4l2_ctx->input_format.fmt.pix_mp;
+	for (uint32_t i = 0; i < pix_mp->num_planes; i++)
+		inbuf->plane[i].bytesused = pix_mp->plane_fmt[i].sizeimage;
 
 	/* coded buffer */
 	obj_buffer = encode_state->coded_buf_object;
@@ -254,7 +301,7 @@ rk_enc_push_buffer
 		coded_buffer_segment = (VACodedBufferSegment *)
 			obj_buffer->buffer_store->buffer;
 
-		coded_buffer_segment->buf = outbuf->plane[0].data;
+		coded_buffer_segment->buf = v4l2_bo_map(outbuf, 0);
 		ASSERT(coded_buffer_segment->buf);
 
 		header_length = param->bit_length / 8;
@@ -353,10 +400,17 @@ rk_enc_v4l2_jpeg_encode_picture
 		rk_v4l2_streamon_all(video_ctx);
 
 	/* get the input buffer to push input data in the future step */
-	rk_enc_prepare_buffer(ctx, encode_state, encode_context);
+	if (!rk_enc_prepare_buffer(ctx, encode_state, encode_context))
+		return VA_STATUS_ERROR_INVALID_SURFACE;
 
 	/* do the slice level encoding here */
-	rk_enc_jpeg_format_qual(ctx, encode_state, encode_context);
+	if (!rk_enc_jpeg_format_qual(ctx, encode_state, encode_context)) {
+		/* The buffer taken for the frame goes back */
+		if (encode_context->inbuf != obj_surface->bo)
+			rk_v4l2_put_input_buffer(video_ctx,
+					encode_context->inbuf);
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
 
 	/* 
 	 * I dont think I need this for loop either. Just to be consistent 
@@ -414,6 +468,55 @@ union codec_state *codec_state, struct hw_context *hw_context)
 	};
 }
 
+/* 
+ * Encode from the memory of the surfaces when all of them could hold
+ * a picture, or the application writes into our buffers.
+ */
+static bool
+rk_enc_import_input(VADriverContextP ctx, struct rk_v4l2_object *video_ctx,
+		struct object_context *obj_context)
+{
+	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
+	struct object_surface *obj_surface;
+	uint32_t sizeimage;
+
+	if (0 == obj_context->num_render_targets
+		|| NULL == obj_context->render_targets)
+		return false;
+
+	/* A surface is a single dma-buf */
+	if (video_ctx->input_format.fmt.pix_mp.num_planes > 1)
+		return false;
+
+	sizeimage = video_ctx->input_format.fmt.pix_mp.plane_fmt[0].sizeimage;
+	for (int32_t i = 0; i < obj_context->num_render_targets; i++) {
+		obj_surface = SURFACE(obj_context->render_targets[i]);
+		if (NULL == obj_surface || NULL == obj_surface->own_bo
+			|| obj_surface->own_bo->plane[0].length < sizeimage)
+			return false;
+		/* The pitches of the caller are not changed */
+		if (obj_surface->external && !rk_v4l2_buffer_fits_format
+			(obj_surface->own_bo, &video_ctx->input_format))
+			return false;
+	}
+
+	rk_v4l2_set_input_memory(video_ctx, V4L2_MEMORY_DMABUF);
+	if (0 == video_ctx->ops.input_alloc(video_ctx, 4)) {
+		rk_info_msg("Failed to import the surfaces as OUTPUT\n");
+		rk_v4l2_set_input_memory(video_ctx, V4L2_MEMORY_MMAP);
+		return false;
+	}
+
+	/* The application writes the pictures in the pitch of the VPU */
+	for (int32_t i = 0; i < obj_context->num_render_targets; i++) {
+		obj_surface = SURFACE(obj_context->render_targets[i]);
+		rk_v4l2_buffer_set_layout(obj_surface->own_bo,
+				&video_ctx->input_format);
+	}
+
+	return true;
+}
+
 VAStatus
 encoder_rk_v4l2_init
 (VADriverContextP ctx, struct object_context *obj_context, 
@@ -426,6 +529,8 @@ encoder_rk_v4l2_init
 		(struct rk_enc_v4l2_context *)hw_context;
 	struct rk_v4l2_object *video_ctx;
 	struct object_config *obj_config;
+	struct rk_v4l2_device_info *device;
+	int64_t pixels;
 
 	uint32_t v4l2_codec_type;
 	int32_t ret;
@@ -442,10 +547,24 @@ encoder_rk_v4l2_init
 	if (!v4l2_codec_type)
 		return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
 
-	/* Create RK V4L2 Object */
-	video_ctx = rk_v4l2_enc_create(NULL);
-	if (NULL == video_ctx)
+	/* 
+	 * Create RK V4L2 Object on the least busy node, look it up by
+	 * name if none is probed.
+	 */
+	pixels = (int64_t)obj_context->picture_width
+		* obj_context->picture_height;
+	device = rk_place_context(rk_data, true, v4l2_codec_type, pixels);
+	video_ctx = rk_v4l2_enc_create(device ? device->path : NULL);
+	if (NULL == video_ctx) {
+		if (device)
+			rk_v4l2_device_release(&device->load, pixels);
 		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
+	if (device) {
+		rk_v4l2_set_device_load(video_ctx, &device->load, pixels);
+		video_ctx->raw_format = rk_v4l2_pick_raw_format(device);
+		rk_v4l2_set_max_requests(video_ctx, device->max_reqs);
+	}
 
 	video_ctx->input_size.w = obj_context->picture_width;
 	video_ctx->input_size.h = obj_context->picture_height;
@@ -453,8 +572,12 @@ encoder_rk_v4l2_init
 	video_ctx->ops.set_codec(video_ctx, v4l2_codec_type);
 	video_ctx->ops.set_format(video_ctx, 0);
 
-	ret = video_ctx->ops.input_alloc(video_ctx, 4);
-	ASSERT_RET(0 != ret, VA_STATUS_ERROR_ALLOCATION_FAILED);
+	rk_v4l2_ctx->import_input = rk_enc_import_input(ctx, video_ctx,
+			obj_context);
+	if (!rk_v4l2_ctx->import_input) {
+		ret = video_ctx->ops.input_alloc(video_ctx, 4);
+		ASSERT_RET(0 != ret, VA_STATUS_ERROR_ALLOCATION_FAILED);
+	}
 
 	/* FIXME Keep correct nummber of the reference buffer */
 	ret = video_ctx->ops.output_alloc(video_ctx, 1);
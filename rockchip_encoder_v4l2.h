@@ -37,6 +37,10 @@ struct rk_enc_v4l2_context {
 	int32_t profile;
 	VASurfaceID input_yuv_surface;
 	void *wrapper_pdrvctx;
+	/* The VPU reads the memory of the surfaces directly */
+	bool import_input;
+	/* The buffer of the picture being encoded */
+	struct rk_v4l2_buffer *inbuf;
 };
 
 struct hw_context *encoder_v4l2_create_context();
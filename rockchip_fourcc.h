@@ -33,4 +33,10 @@
 #define VA_FOURCC_YVY2 VA_FOURCC('Y','V','Y','2')
 #endif
 
+/* The DRM formats of the exported surfaces, without depending on libdrm */
+#define RK_DRM_FORMAT_R8	VA_FOURCC('R','8',' ',' ')
+#define RK_DRM_FORMAT_GR88	VA_FOURCC('G','R','8','8')
+#define RK_DRM_FORMAT_NV12	VA_FOURCC('N','V','1','2')
+#define RK_DRM_FORMAT_MOD_LINEAR	0
+
 #endif 
@@ -33,7 +33,9 @@ get_image_i420_sw(struct object_image *obj_image, uint8_t * image_data,
 	/* Dest VA image has either I420 or YV12 format.
 	   Source VA surface alway has I420 format */
 	dst[Y] = image_data + obj_image->image.offsets[Y];
-	src[0] = (uint8_t *) obj_surface->bo->plane[0].data;
+	src[0] = (uint8_t *) v4l2_bo_map(obj_surface->bo, 0);
+	if (NULL == src[0])
+		return VA_STATUS_ERROR_OPERATION_FAILED;
 	dst[U] = image_data + obj_image->image.offsets[U];
 	src[1] = src[0] + obj_surface->width * obj_surface->height;
 	dst[V] = image_data + obj_image->image.offsets[V];
@@ -70,6 +72,7 @@ get_image_nv12_sw(struct object_image *obj_image, uint8_t * image_data,
 	       const VARectangle * rect)
 {
 	uint8_t *dst[2], *src[2];
+	uint32_t pitch[2];
 	VAStatus va_status = VA_STATUS_SUCCESS;
 
 	if (!obj_surface)
@@ -79,22 +82,27 @@ get_image_nv12_sw(struct object_image *obj_image, uint8_t * image_data,
 
 	/* Both dest VA image and source surface have NV12 format */
 	dst[0] = image_data + obj_image->image.offsets[0];
-	src[0] = (uint8_t *) obj_surface->bo->plane[0].data;
 	dst[1] = image_data + obj_image->image.offsets[1];
-	src[1] = src[0] + obj_surface->width * obj_surface->height;
+	/* The planes may be apart, in the pitches of the VPU */
+	src[0] = v4l2_bo_map_component(obj_surface->bo, 0);
+	src[1] = v4l2_bo_map_component(obj_surface->bo, 1);
+	if (NULL == src[0] || NULL == src[1])
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+	pitch[0] = obj_surface->bo->component[0].pitch;
+	pitch[1] = obj_surface->bo->component[1].pitch;
 
 	/* Y plane */
 	dst[0] += rect->y * obj_image->image.pitches[0] + rect->x;
-	src[0] += rect->y * obj_surface->width + rect->x;
+	src[0] += rect->y * pitch[0] + rect->x;
 	memcpy_pic(dst[0], obj_image->image.pitches[0],
-		   src[0], obj_surface->width, rect->width, rect->height);
+		   src[0], pitch[0], rect->width, rect->height);
 
 	/* UV plane */
 	dst[1] +=
 	    (rect->y / 2) * obj_image->image.pitches[1] + (rect->x & -2);
-	src[1] += (rect->y / 2) * obj_surface->width + (rect->x & -2);
+	src[1] += (rect->y / 2) * pitch[1] + (rect->x & -2);
 	memcpy_pic(dst[1], obj_image->image.pitches[1],
-		   src[1], obj_surface->width,
+		   src[1], pitch[1],
 		   rect->width, rect->height / 2);
 
 	return va_status;
@@ -26,6 +26,299 @@
 #include "common.h"
 #include "rockchip_driver.h"
 #include "rockchip_memory.h"
+#include "rockchip_backend.h"
+
+static int32_t
+rk_buffer_pool_class(uint32_t size)
+{
+	int32_t shift = RK_POOL_MIN_SHIFT;
+
+	while ((1u << shift) < size && shift < 31)
+		shift++;
+
+	shift -= RK_POOL_MIN_SHIFT;
+	return shift < RK_POOL_NUM_CLASSES ? shift : -1;
+}
+
+static void
+rk_buffer_pool_drain(struct rk_buffer_pool *pool)
+{
+	struct buffer_store *store;
+
+	while (pool->free_stores) {
+		store = pool->free_stores;
+		pool->free_stores = store->next_free;
+		free(store);
+	}
+	pool->num_free_stores = 0;
+
+	for (int32_t i = 0; i < RK_POOL_NUM_CLASSES; i++) {
+		for (uint32_t j = 0; j < pool->classes[i].num_payloads; j++)
+			free(pool->classes[i].payloads[j]);
+		pool->classes[i].num_payloads = 0;
+	}
+	pool->cached_size = 0;
+
+	/* Or it is freed with its last buffer */
+	if (pool->arena && 0 == pool->arena->live)
+		free(pool->arena);
+	pool->arena = NULL;
+	free(pool->spare_arena);
+	pool->spare_arena = NULL;
+}
+
+static void
+rk_buffer_pool_free(struct rk_buffer_pool *pool)
+{
+	rk_buffer_pool_drain(pool);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static void
+rk_buffer_pool_unreference(struct rk_buffer_pool *pool)
+{
+	bool last;
+
+	pthread_mutex_lock(&pool->lock);
+	last = (0 == --pool->ref_count);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (last)
+		rk_buffer_pool_free(pool);
+}
+
+struct rk_buffer_pool *
+rockchip_buffer_pool_create(void)
+{
+	struct rk_buffer_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (NULL == pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->ref_count = 1;
+
+	return pool;
+}
+
+/* The stores still out are freed when they are released */
+void
+rockchip_buffer_pool_destroy(struct rk_buffer_pool *pool)
+{
+	if (NULL == pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closed = true;
+	rk_buffer_pool_drain(pool);
+	pthread_mutex_unlock(&pool->lock);
+
+	rk_buffer_pool_unreference(pool);
+}
+
+static struct buffer_store *
+rk_buffer_pool_get_store(struct rk_buffer_pool *pool)
+{
+	struct buffer_store *store = NULL;
+
+	if (NULL == pool)
+		return calloc(1, sizeof(struct buffer_store));
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->closed) {
+		pthread_mutex_unlock(&pool->lock);
+		return calloc(1, sizeof(struct buffer_store));
+	}
+	if (pool->free_stores) {
+		store = pool->free_stores;
+		pool->free_stores = store->next_free;
+		pool->num_free_stores--;
+	}
+	pool->ref_count++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (NULL == store) {
+		store = calloc(1, sizeof(struct buffer_store));
+		if (NULL == store) {
+			rk_buffer_pool_unreference(pool);
+			return NULL;
+		}
+	}
+	store->next_free = NULL;
+	store->pool = pool;
+
+	return store;
+}
+
+/* Called with the lock held */
+static uint8_t *
+rk_buffer_arena_alloc(struct rk_buffer_pool *pool, struct buffer_store *store,
+		uint32_t size)
+{
+	struct rk_buffer_arena *arena = pool->arena;
+	uint8_t *payload;
+
+	size = ALIGN(size, RK_POOL_ARENA_ALIGN);
+
+	if (NULL == arena) {
+		if (pool->spare_arena) {
+			arena = pool->spare_arena;
+			pool->spare_arena = NULL;
+		}
+		else {
+			/* malloc() only aligns to 8 bytes on 32-bit targets */
+			if (posix_memalign((void **)&arena,
+					RK_POOL_ARENA_ALIGN, sizeof(*arena)))
+				return NULL;
+		}
+		arena->used = 0;
+		arena->live = 0;
+		pool->arena = arena;
+	}
+
+	if (arena->used + size > RK_POOL_ARENA_SIZE)
+		return NULL;
+
+	payload = arena->data + arena->used;
+	arena->used += size;
+	arena->live++;
+	store->arena = arena;
+
+	return payload;
+}
+
+/* Called with the lock held, the arena is freed when it returns true */
+static bool
+rk_buffer_arena_put(struct rk_buffer_pool *pool, struct rk_buffer_arena *arena)
+{
+	if (--arena->live || arena == pool->arena)
+		return false;
+
+	if (!pool->closed && NULL == pool->spare_arena) {
+		pool->spare_arena = arena;
+		return false;
+	}
+
+	return true;
+}
+
+void
+rockchip_buffer_pool_reset_arena(struct rk_buffer_pool *pool)
+{
+	if (NULL == pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->arena) {
+		if (0 == pool->arena->live)
+			pool->arena->used = 0;
+		else
+			pool->arena = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static bool
+rk_buffer_arena_type(VABufferType type)
+{
+	switch (type) {
+	case VAPictureParameterBufferType:
+	case VAIQMatrixBufferType:
+	case VASliceParameterBufferType:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static uint8_t *
+rk_buffer_pool_get_payload(struct buffer_store *store, VABufferType type,
+		uint32_t size)
+{
+	struct rk_buffer_pool *pool = store->pool;
+	uint8_t *payload = NULL;
+	int32_t cls;
+
+	if (NULL == pool)
+		return malloc(size);
+
+	pthread_mutex_lock(&pool->lock);
+	if (rk_buffer_arena_type(type) && size <= RK_POOL_ARENA_MAX_ALLOC
+	    && !pool->closed) {
+		payload = rk_buffer_arena_alloc(pool, store, size);
+		if (payload) {
+			pthread_mutex_unlock(&pool->lock);
+			return payload;
+		}
+	}
+
+	cls = rk_buffer_pool_class(size);
+	if (cls >= 0 && pool->classes[cls].num_payloads) {
+		payload = pool->classes[cls].payloads
+			[--pool->classes[cls].num_payloads];
+		pool->cached_size -= 1u << (cls + RK_POOL_MIN_SHIFT);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (cls < 0)
+		return malloc(size);
+
+	store->capacity = 1u << (cls + RK_POOL_MIN_SHIFT);
+	if (NULL == payload)
+		payload = malloc(store->capacity);
+
+	return payload;
+}
+
+static void
+rk_buffer_pool_put(struct buffer_store *store)
+{
+	struct rk_buffer_pool *pool = store->pool;
+	uint8_t *payload = store->buffer;
+	struct rk_buffer_arena *arena = NULL;
+	int32_t cls;
+	bool last;
+
+	pthread_mutex_lock(&pool->lock);
+	if (store->arena) {
+		if (rk_buffer_arena_put(pool, store->arena))
+			arena = store->arena;
+		payload = NULL;
+	}
+
+	/* A payload put in later by someone else is not from the pool */
+	if (payload && store->capacity && !pool->closed) {
+		cls = rk_buffer_pool_class(store->capacity);
+		if (cls >= 0
+		    && pool->classes[cls].num_payloads < RK_POOL_MAX_PAYLOADS
+		    && pool->cached_size + store->capacity
+		    <= RK_POOL_MAX_CACHED) {
+			pool->classes[cls].payloads
+				[pool->classes[cls].num_payloads++] = payload;
+			pool->cached_size += store->capacity;
+			payload = NULL;
+		}
+	}
+
+	if (!pool->closed && pool->num_free_stores < RK_POOL_MAX_STORES) {
+		memset(store, 0, sizeof(*store));
+		store->next_free = pool->free_stores;
+		pool->free_stores = store;
+		pool->num_free_stores++;
+		store = NULL;
+	}
+	last = (0 == --pool->ref_count);
+	pthread_mutex_unlock(&pool->lock);
+
+	free(arena);
+	free(payload);
+	free(store);
+
+	if (last)
+		rk_buffer_pool_free(pool);
+}
 
 void
 rockchip_reference_buffer_store(struct buffer_store **ptr, 
@@ -44,15 +337,20 @@ void rockchip_release_buffer_store(struct buffer_store **ptr)
 	if (NULL == buffer_store)
 		return;
 
-	assert(buffer_store->bo || buffer_store->buffer);
+	/* The bo of a slice data buffer is taken by the decoder */
 	buffer_store->ref_count--;
 
 	if (0 == buffer_store->ref_count) {
 		v4l2_bo_unreference(buffer_store->bo);
-		free(buffer_store->buffer);
-		buffer_store->buffer = NULL;
 		buffer_store->bo = NULL;
-		free(buffer_store);
+		if (buffer_store->pool) {
+			rk_buffer_pool_put(buffer_store);
+		}
+		else {
+			free(buffer_store->buffer);
+			buffer_store->buffer = NULL;
+			free(buffer_store);
+		}
 	}
 
 	*ptr = NULL;
@@ -66,6 +364,7 @@ void *data, VABufferID * buf_id)
 	struct rockchip_driver_data *rk_data = rockchip_driver_data(ctx);
 	VAStatus vaStatus = VA_STATUS_ERROR_UNKNOWN;
 	struct object_buffer *obj_buffer;
+	struct object_context *obj_context;
 	struct buffer_store *buffer_store = NULL;
 	int bufferID;
 
@@ -118,18 +417,33 @@ void *data, VABufferID * buf_id)
 	obj_buffer->export_refcount = 0;
 	obj_buffer->context_id = context;
 
-	buffer_store = calloc(1, sizeof(struct buffer_store));
+	obj_context = CONTEXT(context);
+	buffer_store = rk_buffer_pool_get_store
+		(obj_context ? obj_context->buffer_pool : NULL);
 	assert(buffer_store);
 	buffer_store->ref_count = 1;
 
-	/* FIXME you need improve performance here, using something like DRI */
-	int msize = size;
+	/* Let the application write into the hardware memory directly */
+	if (obj_context && obj_context->hw_context
+		&& obj_context->hw_context->alloc_buffer)
+		buffer_store->bo = obj_context->hw_context->alloc_buffer
+			(ctx, obj_context->hw_context, type,
+			 size * num_elements, &buffer_store->offset);
 
-	buffer_store->buffer = malloc(msize * num_elements);
+	if (buffer_store->bo) {
+		if (data)
+			memcpy((uint8_t *)v4l2_bo_map(buffer_store->bo, 0)
+				+ buffer_store->offset, data,
+				size * num_elements);
+	}
+	else {
+		buffer_store->buffer = rk_buffer_pool_get_payload
+			(buffer_store, type, size * num_elements);
 
-	if (data) {
-		assert(buffer_store->buffer);
-		memcpy(buffer_store->buffer, data, size * num_elements);
+		if (data) {
+			assert(buffer_store->buffer);
+			memcpy(buffer_store->buffer, data, size * num_elements);
+		}
 	}
 
 	buffer_store->num_elements = obj_buffer->num_elements;
@@ -183,8 +497,11 @@ VABufferID *buf_id, struct rk_v4l2_buffer *bo, unsigned int size)
 	buffer_store->ref_count = 1;
 	buffer_store->buffer = NULL;
 
-	if (bo)
+	/* It is kept until the buffer is destroyed */
+	if (bo) {
 		buffer_store->bo = bo;
+		v4l2_bo_reference(bo);
+	}
 
 	buffer_store->num_elements = obj_buffer->num_elements;
 	rockchip_reference_buffer_store(&obj_buffer->buffer_store,
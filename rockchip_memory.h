@@ -35,6 +35,12 @@ struct buffer_store *buffer_store);
 
 void rockchip_release_buffer_store(struct buffer_store **ptr);
 
+struct rk_buffer_pool *rockchip_buffer_pool_create(void);
+
+void rockchip_buffer_pool_destroy(struct rk_buffer_pool *pool);
+
+void rockchip_buffer_pool_reset_arena(struct rk_buffer_pool *pool);
+
 VAStatus 
 rockchip_allocate_buffer
 (VADriverContextP ctx, VAContextID context,  VABufferType type, 
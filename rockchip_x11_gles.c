@@ -372,20 +372,22 @@ static VAStatus rockchip_x11_gles_display(
 	};
 
 	/*
-	 * TODO: we should calculate pitch, offset here.
-	 * At current i just assume srcx, srcy is zero.
+	 * TODO: At current i just assume srcx, srcy is zero.
 	 * Also it only works for NV12.
 	 */
+	if (bo->num_components != 2)
+		return VA_STATUS_ERROR_INVALID_SURFACE;
+
 	attrs[1] = srcw;
 	attrs[3] = srch;
 	attrs[5] = fourcc;
-	attrs[7] = bo->plane[0].dma_fd;
-	attrs[9] = 0;
-	attrs[11] = sufacew; // pitch
+	attrs[7] = bo->plane[bo->component[0].plane].dma_fd;
+	attrs[9] = bo->component[0].offset;
+	attrs[11] = bo->component[0].pitch;
 
-	attrs[13] = bo->plane[0].dma_fd;
-	attrs[15] = sufacew * sufaceh; // offset
-	attrs[17] = sufacew; // pitch
+	attrs[13] = bo->plane[bo->component[1].plane].dma_fd;
+	attrs[15] = bo->component[1].offset;
+	attrs[17] = bo->component[1].pitch;
 	attrs[19] = EGL_ITU_REC601_EXT;
 	attrs[21] = EGL_YUV_NARROW_RANGE_EXT;
 
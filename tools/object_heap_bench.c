@@ -0,0 +1,118 @@
+/*
+ * Measure the object lookups while another thread allocates and frees
+ * objects of the same heap, as the decoder and the application do.
+ *
+ * usage: object_heap_bench [-l] [readers] [seconds]
+ * -l takes the heap mutex around each lookup, as the heap did before
+ *    the lookups were made lock free, for a comparison.
+ */
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "object_heap.h"
+
+#define NUM_IDS		64
+#define MAX_READERS	64
+
+struct object_bench {
+	struct object_base base;
+	int data[8];
+};
+
+static struct object_heap heap;
+static int ids[NUM_IDS];
+static bool stop;
+static bool locked;
+
+static void *
+lookup_thread(void *arg)
+{
+	unsigned int seed = (uintptr_t)arg;
+	uintptr_t found = 0;
+	object_base_p obj;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (int i = 0; i < 1000; i++) {
+			seed = seed * 1103515245 + 12345;
+			if (locked)
+				pthread_mutex_lock(&heap.mutex);
+			obj = object_heap_lookup(&heap,
+					ids[(seed >> 8) % NUM_IDS]);
+			if (locked)
+				pthread_mutex_unlock(&heap.mutex);
+			if (obj)
+				found++;
+		}
+	}
+
+	return (void *)found;
+}
+
+static void *
+allocate_thread(void *arg)
+{
+	int id;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		id = object_heap_allocate(&heap);
+		if (id < 0)
+			break;
+		object_heap_free(&heap, object_heap_lookup(&heap, id));
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t readers[MAX_READERS], writer;
+	struct timespec duration = { 1, 0 };
+	uint64_t total = 0;
+	int num_readers = 1;
+	void *found;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l")) != -1) {
+		if ('l' != opt) {
+			fprintf(stderr, "usage: %s [-l] [readers] [seconds]\n",
+					argv[0]);
+			return 2;
+		}
+		locked = true;
+	}
+	if (optind < argc)
+		num_readers = CLAMP(1, MAX_READERS, atoi(argv[optind]));
+	if (optind + 1 < argc)
+		duration.tv_sec = MAX(1, atoi(argv[optind + 1]));
+
+	if (object_heap_init(&heap, sizeof(struct object_bench), 0x04000000))
+		return 1;
+	for (int i = 0; i < NUM_IDS; i++)
+		ids[i] = object_heap_allocate(&heap);
+
+	pthread_create(&writer, NULL, allocate_thread, NULL);
+	for (int i = 0; i < num_readers; i++)
+		pthread_create(&readers[i], NULL, lookup_thread,
+				(void *)(uintptr_t)(i + 1));
+
+	nanosleep(&duration, NULL);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < num_readers; i++) {
+		pthread_join(readers[i], &found);
+		total += (uintptr_t)found;
+	}
+	pthread_join(writer, NULL);
+
+	printf("%d readers, %s lookups: %.1f M lookups/s\n", num_readers,
+			locked ? "locked" : "lock free",
+			total / 1e6 / duration.tv_sec);
+
+	for (int i = 0; i < NUM_IDS; i++)
+		object_heap_free(&heap, object_heap_lookup(&heap, ids[i]));
+	object_heap_destroy(&heap);
+
+	return 0;
+}
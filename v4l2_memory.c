@@ -24,12 +24,226 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "config.h"
+#ifdef HAVE_LIBDRM
+#include <xf86drm.h>
+#include <drm_mode.h>
+#endif
 #include "v4l2_memory.h"
+#include "rockchip_debug.h"
 
 void v4l2_bo_reference(struct rk_v4l2_buffer *bo)
 {
+	if (NULL != bo)
+		bo->ref_count++;
 }
 
 void v4l2_bo_unreference(struct rk_v4l2_buffer *bo)
 {
+	if (NULL == bo || bo->ref_count <= 0)
+		return;
+
+	if (--bo->ref_count > 0)
+		return;
+
+	if (bo->release)
+		bo->release(bo, bo->release_data);
+}
+
+void *v4l2_bo_map(struct rk_v4l2_buffer *bo, uint32_t plane)
+{
+	void *ptr;
+
+	if (NULL == bo || plane >= bo->length)
+		return NULL;
+
+	if (NULL != bo->plane[plane].data)
+		return bo->plane[plane].data;
+
+	if (bo->plane[plane].dma_fd < 0 || 0 == bo->plane[plane].length)
+		return NULL;
+
+	ptr = mmap(NULL, bo->plane[plane].length, PROT_READ | PROT_WRITE,
+			MAP_SHARED, bo->plane[plane].dma_fd, 0);
+	if (MAP_FAILED == ptr) {
+		rk_error_msg("Failed to map plane %u of buffer %u\n",
+				plane, bo->index);
+		return NULL;
+	}
+	bo->plane[plane].data = ptr;
+
+	return ptr;
+}
+
+void v4l2_bo_set_nv12_layout(struct rk_v4l2_buffer *bo, uint32_t luma_pitch,
+		uint32_t chroma_pitch, uint32_t height)
+{
+	bo->num_components = 2;
+	bo->component[0].plane = 0;
+	bo->component[0].offset = 0;
+	bo->component[0].pitch = luma_pitch;
+
+	bo->component[1].pitch = chroma_pitch;
+	if (bo->length > 1) {
+		bo->component[1].plane = 1;
+		bo->component[1].offset = 0;
+	}
+	else {
+		bo->component[1].plane = 0;
+		bo->component[1].offset = luma_pitch * height;
+	}
+}
+
+uint8_t *v4l2_bo_map_component(struct rk_v4l2_buffer *bo, uint32_t component)
+{
+	uint8_t *ptr;
+
+	if (NULL == bo || component >= bo->num_components)
+		return NULL;
+
+	ptr = v4l2_bo_map(bo, bo->component[component].plane);
+	if (NULL == ptr)
+		return NULL;
+
+	return ptr + bo->component[component].offset;
+}
+
+struct rk_v4l2_buffer *v4l2_bo_alloc_dumb(int32_t drm_fd, uint32_t size)
+{
+#ifdef HAVE_LIBDRM
+	struct drm_mode_create_dumb create_arg;
+	struct drm_mode_destroy_dumb destroy_arg;
+	struct rk_v4l2_buffer *bo;
+	int32_t prime_fd = -1;
+
+	if (drm_fd < 0 || 0 == size)
+		return NULL;
+
+	bo = calloc(1, sizeof(*bo));
+	if (NULL == bo)
+		return NULL;
+
+	/* A linear buffer of size bytes */
+	memset(&create_arg, 0, sizeof(create_arg));
+	create_arg.bpp = 8;
+	create_arg.width = 4096;
+	create_arg.height = (size + 4095) / 4096;
+	if (drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg)) {
+		rk_error_msg("Failed to create a dumb buffer of %u bytes\n",
+				size);
+		free(bo);
+		return NULL;
+	}
+
+	if (drmPrimeHandleToFD(drm_fd, create_arg.handle,
+				DRM_CLOEXEC | DRM_RDWR, &prime_fd))
+		goto err;
+
+	/* The dma-buf keeps the memory, mapped by v4l2_bo_map() on demand */
+	memset(&destroy_arg, 0, sizeof(destroy_arg));
+	destroy_arg.handle = create_arg.handle;
+	drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+
+	bo->plane[0].length = create_arg.size;
+	bo->plane[0].dma_fd = prime_fd;
+	bo->length = 1;
+	bo->index = -1;
+	bo->state = BUFFER_FREE;
+
+	return bo;
+err:
+	rk_error_msg("Failed to export a dumb buffer\n");
+	memset(&destroy_arg, 0, sizeof(destroy_arg));
+	destroy_arg.handle = create_arg.handle;
+	drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+	free(bo);
+#endif
+	return NULL;
+}
+
+struct rk_v4l2_buffer *v4l2_bo_import_dmabuf(const int32_t *fds,
+		const uint32_t *sizes, uint32_t num_fds)
+{
+	struct rk_v4l2_buffer *bo;
+	off_t size;
+
+	if (0 == num_fds || num_fds > RK_VIDEO_MAX_PLANES)
+		return NULL;
+
+	bo = calloc(1, sizeof(*bo));
+	if (NULL == bo)
+		return NULL;
+
+	for (uint32_t i = 0; i < RK_VIDEO_MAX_PLANES; i++)
+		bo->plane[i].dma_fd = -1;
+	bo->index = -1;
+	bo->state = BUFFER_FREE;
+
+	for (uint32_t i = 0; i < num_fds; i++) {
+		size = sizes ? sizes[i] : 0;
+		if (0 == size)
+			size = lseek(fds[i], 0, SEEK_END);
+		if (size <= 0) {
+			rk_error_msg("Failed to get the size of dma-buf %d\n",
+					fds[i]);
+			goto err;
+		}
+
+		bo->plane[i].dma_fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+		if (bo->plane[i].dma_fd < 0)
+			goto err;
+		bo->plane[i].length = size;
+		bo->length++;
+	}
+
+	return bo;
+err:
+	v4l2_bo_free(bo);
+	return NULL;
+}
+
+bool v4l2_bo_copy_nv12(struct rk_v4l2_buffer *dst,
+		struct rk_v4l2_buffer *src, uint32_t width, uint32_t height)
+{
+	uint8_t *from, *to;
+
+	if (NULL == dst || NULL == src || dst->num_components != 2
+		|| src->num_components != 2)
+		return false;
+
+	for (uint32_t i = 0; i < 2; i++) {
+		from = v4l2_bo_map_component(src, i);
+		to = v4l2_bo_map_component(dst, i);
+		if (NULL == from || NULL == to)
+			return false;
+
+		/* The chroma is half of the lines, rounded up */
+		for (uint32_t y = 0; y < (i ? (height + 1) / 2 : height); y++) {
+			memcpy(to, from, width);
+			to += dst->component[i].pitch;
+			from += src->component[i].pitch;
+		}
+	}
+
+	return true;
+}
+
+void v4l2_bo_free(struct rk_v4l2_buffer *bo)
+{
+	if (NULL == bo)
+		return;
+
+	for (uint32_t i = 0; i < bo->length; i++) {
+		if (NULL != bo->plane[i].data)
+			munmap(bo->plane[i].data, bo->plane[i].length);
+		if (bo->plane[i].dma_fd >= 0)
+			close(bo->plane[i].dma_fd);
+	}
+
+	free(bo);
 }
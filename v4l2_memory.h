@@ -2,13 +2,18 @@
 #define _V4L2_MEMORY_H_
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define RK_VIDEO_MAX_PLANES 3
 
 enum {
 	BUFFER_FREE,
+	/* Taken from the pool, being filled by the driver */
+	BUFFER_FILLED,
 	BUFFER_ENQUEUED,
 	BUFFER_DEQUEUED,
+	/* Held by the application to be filled */
+	BUFFER_CLAIMED,
 };
 
 struct rk_v4l2_buffer {
@@ -21,10 +26,64 @@ struct rk_v4l2_buffer {
 	uint32_t index;
 	int32_t state;
 	uint32_t length;
+	/* The request it is queued with, 0 if none */
+	uint16_t request;
+	/* 
+	 * Where the components of a raw picture are, a memory plane
+	 * each for NV12M or all in the first one for NV12.
+	 */
+	uint32_t num_components;
+	struct {
+		uint32_t plane;
+		uint32_t offset;
+		uint32_t pitch;
+	} component[RK_VIDEO_MAX_PLANES];
+	/* The users which have to finish with it before it is reused */
+	int32_t ref_count;
+	/* Called when the last reference is dropped */
+	void (*release) (struct rk_v4l2_buffer *bo, void *data);
+	void *release_data;
 };
 
 void v4l2_bo_reference(struct rk_v4l2_buffer *bo);
 
+/* The last one gives the buffer back to its owner */
 void v4l2_bo_unreference(struct rk_v4l2_buffer *bo);
 
+/*
+ * The CPU mapping of a plane is created at the first access and kept
+ * until the owner of the buffer releases it, return NULL if failed
+ */
+void *v4l2_bo_map(struct rk_v4l2_buffer *bo, uint32_t plane);
+
+/* 
+ * Lay a NV12 picture out in the buffer, the chroma follows the luma of
+ * height lines unless the buffer has a memory plane for it.
+ */
+void v4l2_bo_set_nv12_layout(struct rk_v4l2_buffer *bo, uint32_t luma_pitch,
+		uint32_t chroma_pitch, uint32_t height);
+
+/* The CPU address of a component, NULL if it has no layout */
+uint8_t *v4l2_bo_map_component(struct rk_v4l2_buffer *bo, uint32_t component);
+
+/* 
+ * A buffer not belonged to any V4L2 queue, it is exported as a
+ * dma-buf so it could be imported by the VPU or the display.
+ */
+struct rk_v4l2_buffer *v4l2_bo_alloc_dumb(int32_t drm_fd, uint32_t size);
+
+/*
+ * Wrap the dma-bufs of the caller, a memory plane each. They are
+ * duplicated, so the caller keeps its fds. A size of 0 is asked from
+ * the dma-buf. The layout of the picture is left to the caller.
+ */
+struct rk_v4l2_buffer *v4l2_bo_import_dmabuf(const int32_t *fds,
+		const uint32_t *sizes, uint32_t num_fds);
+
+/* Copy a NV12 picture between the layouts of two buffers */
+bool v4l2_bo_copy_nv12(struct rk_v4l2_buffer *dst,
+		struct rk_v4l2_buffer *src, uint32_t width, uint32_t height);
+
+void v4l2_bo_free(struct rk_v4l2_buffer *bo);
+
 #endif
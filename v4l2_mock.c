@@ -0,0 +1,812 @@
+/*
+ * Copyright © 2016 Rockchip Co., Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include "v4l2_mock.h"
+#include "rockchip_debug.h"
+
+#define MOCK_MAX_INSTANCES	32
+#define MOCK_MAX_WIDTH		4096
+#define MOCK_MAX_HEIGHT		2304
+#define MOCK_MAX_REQS		32
+/* How much smaller a coded picture is than the raw one */
+#define MOCK_CODING_RATIO	8
+/* Latency of a job unless ROCKCHIP_VPU_MOCK_LATENCY_US is set */
+#define MOCK_DEFAULT_LATENCY_US	4000
+
+#define MOCK_OUTPUT	0
+#define MOCK_CAPTURE	1
+
+struct mock_device {
+	const char *path;
+	const char *card;
+	bool is_encoder;
+	uint32_t coded_format;
+	uint32_t raw_format;
+	/* The first control of a picture */
+	uint32_t codec_control;
+};
+
+static const struct mock_device mock_devices[] = {
+	{
+		.path = "mock:decoder",
+		.card = "mock-vpu-dec",
+		.is_encoder = false,
+		.coded_format = V4L2_PIX_FMT_H264_SLICE,
+		.raw_format = V4L2_PIX_FMT_NV12,
+		.codec_control = V4L2_CID_MPEG_VIDEO_H264_SPS,
+	},
+	{
+		.path = "mock:encoder",
+		.card = "mock-vpu-enc",
+		.is_encoder = true,
+		.coded_format = V4L2_PIX_FMT_JPEG,
+		.raw_format = V4L2_PIX_FMT_NV12,
+		.codec_control = V4L2_CID_JPEG_QMATRIX,
+	},
+};
+
+static const char *const mock_device_paths[] = {
+	"mock:decoder",
+	"mock:encoder",
+	NULL,
+};
+
+struct mock_buffer {
+	int32_t fd[VIDEO_MAX_PLANES];
+	uint32_t length[VIDEO_MAX_PLANES];
+	uint32_t bytesused[VIDEO_MAX_PLANES];
+	uint32_t num_planes;
+	/* When the job it belongs to is done, 0 if it is not in one yet */
+	uint64_t done_ns;
+};
+
+struct mock_queue {
+	struct v4l2_format format;
+	uint32_t memory;
+	struct mock_buffer buffers[VIDEO_MAX_FRAME];
+	uint32_t num_buffers;
+	/* The queued buffers, the earliest first */
+	uint32_t fifo[VIDEO_MAX_FRAME];
+	uint32_t head;
+	uint32_t count;
+	bool streaming;
+};
+
+struct mock_instance {
+	int32_t fd;
+	const struct mock_device *device;
+	struct mock_queue queues[2];
+	/* The jobs are run one after another like the hardware does */
+	uint64_t busy_until_ns;
+	uint32_t num_jobs;
+	uint32_t num_controls;
+	uint64_t total_wait_ns;
+};
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mock_instance *mock_instances[MOCK_MAX_INSTANCES];
+static uint64_t mock_latency_ns;
+static FILE *mock_dump;
+
+static uint64_t
+mock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+mock_sleep(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+
+	while (nanosleep(&ts, &ts) && EINTR == errno);
+}
+
+static struct mock_instance *
+mock_lookup(int32_t fd)
+{
+	for (int32_t i = 0; i < MOCK_MAX_INSTANCES; i++)
+		if (mock_instances[i] && mock_instances[i]->fd == fd)
+			return mock_instances[i];
+
+	return NULL;
+}
+
+static struct mock_queue *
+mock_queue_of(struct mock_instance *inst, uint32_t type)
+{
+	if (V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE == type)
+		return &inst->queues[MOCK_OUTPUT];
+	if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == type)
+		return &inst->queues[MOCK_CAPTURE];
+
+	return NULL;
+}
+
+static bool
+mock_queue_is_coded(struct mock_instance *inst, uint32_t type)
+{
+	/* The decoder takes the bitstream, the encoder gives it */
+	return inst->device->is_encoder ?
+		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == type :
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE == type;
+}
+
+static void
+mock_queue_release(struct mock_queue *queue)
+{
+	for (uint32_t i = 0; i < queue->num_buffers; i++) {
+		for (uint32_t j = 0; j < queue->buffers[i].num_planes; j++)
+			if (queue->buffers[i].fd[j] >= 0)
+				close(queue->buffers[i].fd[j]);
+	}
+	memset(queue->buffers, 0, sizeof(queue->buffers));
+	queue->num_buffers = 0;
+	queue->head = 0;
+	queue->count = 0;
+}
+
+static int32_t
+mock_memfd(uint32_t size)
+{
+	int32_t fd;
+
+	fd = syscall(SYS_memfd_create, "rk-vpu-mock", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int32_t
+mock_reqbufs(struct mock_instance *inst, struct v4l2_requestbuffers *breq)
+{
+	struct mock_queue *queue = mock_queue_of(inst, breq->type);
+	struct v4l2_pix_format_mplane *pix_mp;
+
+	if (NULL == queue)
+		return -EINVAL;
+	if (queue->streaming && breq->count)
+		return -EBUSY;
+
+	mock_queue_release(queue);
+	queue->memory = breq->memory;
+	if (breq->count > VIDEO_MAX_FRAME)
+		breq->count = VIDEO_MAX_FRAME;
+
+	pix_mp = &queue->format.fmt.pix_mp;
+	for (uint32_t i = 0; i < breq->count; i++) {
+		struct mock_buffer *buffer = &queue->buffers[i];
+
+		buffer->num_planes = pix_mp->num_planes;
+		for (uint32_t j = 0; j < pix_mp->num_planes; j++) {
+			buffer->length[j] = pix_mp->plane_fmt[j].sizeimage;
+			buffer->fd[j] = -1;
+			/* The imported buffers are given at QBUF */
+			if (V4L2_MEMORY_MMAP != breq->memory)
+				continue;
+
+			buffer->fd[j] = mock_memfd(buffer->length[j]);
+			if (buffer->fd[j] < 0)
+				goto out;
+		}
+		queue->num_buffers++;
+	}
+
+out:
+	/* The buffer failed is dropped by the next release */
+	breq->count = queue->num_buffers;
+	return 0;
+}
+
+static int32_t
+mock_querybuf(struct mock_instance *inst, struct v4l2_buffer *buf)
+{
+	struct mock_queue *queue = mock_queue_of(inst, buf->type);
+	struct mock_buffer *buffer;
+
+	if (NULL == queue || buf->index >= queue->num_buffers)
+		return -EINVAL;
+
+	buffer = &queue->buffers[buf->index];
+	if (buf->length < buffer->num_planes)
+		return -EINVAL;
+
+	buf->length = buffer->num_planes;
+	for (uint32_t j = 0; j < buffer->num_planes; j++) {
+		buf->m.planes[j].length = buffer->length[j];
+		buf->m.planes[j].m.mem_offset = (buf->index << 4 | j) << 12;
+	}
+
+	return 0;
+}
+
+static int32_t
+mock_expbuf(struct mock_instance *inst, struct v4l2_exportbuffer *expbuf)
+{
+	struct mock_queue *queue = mock_queue_of(inst, expbuf->type);
+	struct mock_buffer *buffer;
+
+	if (NULL == queue || expbuf->index >= queue->num_buffers
+			|| V4L2_MEMORY_MMAP != queue->memory)
+		return -EINVAL;
+
+	buffer = &queue->buffers[expbuf->index];
+	if (expbuf->plane >= buffer->num_planes)
+		return -EINVAL;
+
+	expbuf->fd = fcntl(buffer->fd[expbuf->plane], F_DUPFD_CLOEXEC, 0);
+	if (expbuf->fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Hand the earliest capture buffer nothing is decoded into to a job */
+static void
+mock_claim_capture(struct mock_instance *inst, uint32_t raw_size,
+		uint64_t done_ns)
+{
+	struct mock_queue *queue = &inst->queues[MOCK_CAPTURE];
+
+	for (uint32_t i = 0; i < queue->count; i++) {
+		struct mock_buffer *buffer;
+
+		buffer = &queue->buffers[queue->fifo[(queue->head + i)
+			% VIDEO_MAX_FRAME]];
+		if (buffer->done_ns)
+			continue;
+
+		buffer->done_ns = done_ns;
+		for (uint32_t j = 0; j < buffer->num_planes; j++) {
+			buffer->bytesused[j] = buffer->length[j];
+			if (inst->device->is_encoder
+					&& raw_size / MOCK_CODING_RATIO
+					< buffer->length[j])
+				buffer->bytesused[j] =
+					raw_size / MOCK_CODING_RATIO;
+		}
+		return;
+	}
+}
+
+static int32_t
+mock_qbuf(struct mock_instance *inst, struct v4l2_buffer *buf)
+{
+	struct mock_queue *queue = mock_queue_of(inst, buf->type);
+	struct mock_buffer *buffer;
+	uint32_t raw_size = 0;
+	uint64_t now;
+
+	if (NULL == queue || buf->index >= queue->num_buffers
+			|| queue->count >= VIDEO_MAX_FRAME)
+		return -EINVAL;
+
+	buffer = &queue->buffers[buf->index];
+	for (uint32_t j = 0; j < buffer->num_planes; j++) {
+		buffer->bytesused[j] = buf->m.planes[j].bytesused;
+		raw_size += buffer->bytesused[j];
+	}
+	buffer->done_ns = 0;
+
+	queue->fifo[(queue->head + queue->count) % VIDEO_MAX_FRAME] =
+		buf->index;
+	queue->count++;
+
+	if (V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE != buf->type)
+		return 0;
+
+	/* A job for each source buffer */
+	now = mock_now();
+	if (inst->busy_until_ns < now)
+		inst->busy_until_ns = now;
+	inst->busy_until_ns += mock_latency_ns;
+	buffer->done_ns = inst->busy_until_ns;
+	inst->num_jobs++;
+
+	mock_claim_capture(inst, raw_size, buffer->done_ns);
+
+	return 0;
+}
+
+/*
+ * Returns 0 and fills the buf when the earliest buffer is done, or the
+ * time to wait for it in ns.
+ */
+static int64_t
+mock_try_dqbuf(struct mock_instance *inst, struct v4l2_buffer *buf)
+{
+	struct mock_queue *queue = mock_queue_of(inst, buf->type);
+	struct mock_buffer *buffer;
+	uint32_t index;
+	uint64_t now;
+
+	if (NULL == queue)
+		return -EINVAL;
+	if (0 == queue->count)
+		return -EAGAIN;
+
+	index = queue->fifo[queue->head];
+	buffer = &queue->buffers[index];
+	/* No job would fill it */
+	if (0 == buffer->done_ns)
+		return -EAGAIN;
+
+	now = mock_now();
+	if (buffer->done_ns > now)
+		return buffer->done_ns - now;
+
+	queue->head = (queue->head + 1) % VIDEO_MAX_FRAME;
+	queue->count--;
+
+	buf->index = index;
+	buf->flags = 0;
+	buf->length = buffer->num_planes;
+	for (uint32_t j = 0; j < buffer->num_planes; j++) {
+		buf->m.planes[j].bytesused = buffer->bytesused[j];
+		buf->m.planes[j].length = buffer->length[j];
+	}
+
+	return 0;
+}
+
+static int32_t
+mock_dqbuf(int32_t fd, struct v4l2_buffer *buf)
+{
+	struct mock_instance *inst;
+	int64_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&mock_lock);
+		inst = mock_lookup(fd);
+		ret = inst ? mock_try_dqbuf(inst, buf) : -EBADF;
+		pthread_mutex_unlock(&mock_lock);
+
+		if (ret <= 0)
+			return ret;
+		if (fcntl(fd, F_GETFL) & O_NONBLOCK)
+			return -EAGAIN;
+
+		mock_sleep(ret);
+		pthread_mutex_lock(&mock_lock);
+		inst = mock_lookup(fd);
+		if (inst)
+			inst->total_wait_ns += ret;
+		pthread_mutex_unlock(&mock_lock);
+	}
+}
+
+static int32_t
+mock_s_fmt(struct mock_instance *inst, struct v4l2_format *format)
+{
+	struct mock_queue *queue = mock_queue_of(inst, format->type);
+	struct v4l2_pix_format_mplane *pix_mp = &format->fmt.pix_mp;
+
+	if (NULL == queue)
+		return -EINVAL;
+	if (queue->num_buffers)
+		return -EBUSY;
+
+	pix_mp->num_planes = 1;
+	if (mock_queue_is_coded(inst, format->type)) {
+		pix_mp->pixelformat = inst->device->coded_format;
+		if (0 == pix_mp->plane_fmt[0].sizeimage)
+			pix_mp->plane_fmt[0].sizeimage = MAX_CODEC_BUFFER;
+	}
+	else {
+		uint32_t luma_size;
+
+		pix_mp->width = ALIGN(pix_mp->width, 16);
+		pix_mp->height = ALIGN(pix_mp->height, 16);
+		if (pix_mp->width > MOCK_MAX_WIDTH
+				|| pix_mp->height > MOCK_MAX_HEIGHT)
+			return -EINVAL;
+
+		/* A pitch wider than the picture, as the VPU may do */
+		luma_size = ALIGN(pix_mp->width, 64) * pix_mp->height;
+		if (V4L2_PIX_FMT_NV12M == pix_mp->pixelformat) {
+			pix_mp->num_planes = 2;
+			pix_mp->plane_fmt[0].sizeimage = luma_size;
+			pix_mp->plane_fmt[1].sizeimage = luma_size / 2;
+		}
+		else {
+			pix_mp->pixelformat = inst->device->raw_format;
+			pix_mp->plane_fmt[0].sizeimage =
+				ALIGN(luma_size * 3 / 2, 4096);
+		}
+		for (uint32_t j = 0; j < pix_mp->num_planes; j++)
+			pix_mp->plane_fmt[j].bytesperline =
+				ALIGN(pix_mp->width, 64);
+	}
+	queue->format = *format;
+
+	return 0;
+}
+
+static int32_t
+mock_streamoff(struct mock_instance *inst, uint32_t type)
+{
+	struct mock_queue *queue = mock_queue_of(inst, type);
+
+	if (NULL == queue)
+		return -EINVAL;
+
+	/* The queued buffers come back to the user */
+	queue->streaming = false;
+	queue->head = 0;
+	queue->count = 0;
+
+	return 0;
+}
+
+static void
+mock_dump_controls(struct v4l2_ext_controls *ext_ctrls)
+{
+	for (uint32_t i = 0; i < ext_ctrls->count; i++) {
+		struct v4l2_ext_control *ctrl = &ext_ctrls->controls[i];
+
+		fprintf(mock_dump, "request %u control 0x%08x size %u:",
+				ext_ctrls->request, ctrl->id, ctrl->size);
+		for (uint32_t j = 0; j < ctrl->size; j++)
+			fprintf(mock_dump, "%s%02x", j % 32 ? " " : "\n  ",
+					ctrl->p_u8[j]);
+		fprintf(mock_dump, "\n");
+	}
+	fflush(mock_dump);
+}
+
+static int32_t
+mock_enum_fmt(struct mock_instance *inst, struct v4l2_fmtdesc *fmtdesc)
+{
+	if (mock_queue_is_coded(inst, fmtdesc->type)) {
+		if (fmtdesc->index)
+			return -EINVAL;
+		fmtdesc->pixelformat = inst->device->coded_format;
+		fmtdesc->flags = V4L2_FMT_FLAG_COMPRESSED;
+		return 0;
+	}
+
+	/* The raw pictures could be in a memory plane each too */
+	if (fmtdesc->index > 1)
+		return -EINVAL;
+	fmtdesc->pixelformat = fmtdesc->index ?
+		V4L2_PIX_FMT_NV12M : inst->device->raw_format;
+	fmtdesc->flags = 0;
+
+	return 0;
+}
+
+static int32_t
+mock_do_ioctl(struct mock_instance *inst, unsigned long request, void *arg)
+{
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *cap = arg;
+
+		memset(cap, 0, sizeof(*cap));
+		snprintf((char *)cap->driver, sizeof(cap->driver), "mock");
+		snprintf((char *)cap->card, sizeof(cap->card), "%s",
+				inst->device->card);
+		cap->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE
+			| V4L2_CAP_STREAMING;
+		cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+	case VIDIOC_ENUM_FMT:
+		return mock_enum_fmt(inst, arg);
+	case VIDIOC_ENUM_FRAMESIZES: {
+		struct v4l2_frmsizeenum *frmsize = arg;
+
+		if (frmsize->index)
+			return -EINVAL;
+		frmsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+		frmsize->stepwise.min_width = 16;
+		frmsize->stepwise.min_height = 16;
+		frmsize->stepwise.max_width = MOCK_MAX_WIDTH;
+		frmsize->stepwise.max_height = MOCK_MAX_HEIGHT;
+		frmsize->stepwise.step_width = 16;
+		frmsize->stepwise.step_height = 16;
+		return 0;
+	}
+	case VIDIOC_QUERY_EXT_CTRL: {
+		struct v4l2_query_ext_ctrl *query = arg;
+
+		if (query->id != inst->device->codec_control)
+			return -EINVAL;
+		query->max_reqs = MOCK_MAX_REQS;
+		return 0;
+	}
+	case VIDIOC_S_FMT:
+		return mock_s_fmt(inst, arg);
+	case VIDIOC_REQBUFS:
+		return mock_reqbufs(inst, arg);
+	case VIDIOC_QUERYBUF:
+		return mock_querybuf(inst, arg);
+	case VIDIOC_EXPBUF:
+		return mock_expbuf(inst, arg);
+	case VIDIOC_QBUF:
+		return mock_qbuf(inst, arg);
+	case VIDIOC_STREAMON: {
+		struct mock_queue *queue = mock_queue_of(inst,
+				*(uint32_t *)arg);
+
+		if (NULL == queue)
+			return -EINVAL;
+		queue->streaming = true;
+		return 0;
+	}
+	case VIDIOC_STREAMOFF:
+		return mock_streamoff(inst, *(uint32_t *)arg);
+	case VIDIOC_S_EXT_CTRLS: {
+		struct v4l2_ext_controls *ext_ctrls = arg;
+
+		inst->num_controls += ext_ctrls->count;
+		if (mock_dump)
+			mock_dump_controls(ext_ctrls);
+		return 0;
+	}
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int32_t
+mock_ioctl(int32_t fd, unsigned long request, void *arg)
+{
+	struct mock_instance *inst;
+	int32_t ret;
+
+	/* It may wait for the job, without the lock */
+	if (VIDIOC_DQBUF == request)
+		ret = mock_dqbuf(fd, arg);
+	else {
+		pthread_mutex_lock(&mock_lock);
+		inst = mock_lookup(fd);
+		ret = inst ? mock_do_ioctl(inst, request, arg) : -EBADF;
+		pthread_mutex_unlock(&mock_lock);
+	}
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int32_t
+mock_open(const char *path, int32_t flags)
+{
+	const struct mock_device *device = NULL;
+	struct mock_instance *inst;
+	int32_t slot = -1;
+
+	for (uint32_t i = 0; i < ARRAY_ELEMS(mock_devices); i++)
+		if (!strcmp(path, mock_devices[i].path))
+			device = &mock_devices[i];
+	if (NULL == device) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	inst = calloc(1, sizeof(*inst));
+	if (NULL == inst) {
+		errno = ENOMEM;
+		return -1;
+	}
+	inst->device = device;
+
+	/* Only a number the instance is found by */
+	inst->fd = eventfd(0, EFD_CLOEXEC
+			| ((flags & O_NONBLOCK) ? EFD_NONBLOCK : 0));
+	if (inst->fd < 0) {
+		free(inst);
+		return -1;
+	}
+
+	pthread_mutex_lock(&mock_lock);
+	for (int32_t i = 0; i < MOCK_MAX_INSTANCES; i++) {
+		if (NULL == mock_instances[i]) {
+			mock_instances[i] = inst;
+			slot = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	if (slot < 0) {
+		close(inst->fd);
+		free(inst);
+		errno = EMFILE;
+		return -1;
+	}
+
+	return inst->fd;
+}
+
+static int32_t
+mock_close(int32_t fd)
+{
+	struct mock_instance *inst = NULL;
+
+	pthread_mutex_lock(&mock_lock);
+	for (int32_t i = 0; i < MOCK_MAX_INSTANCES; i++) {
+		if (mock_instances[i] && mock_instances[i]->fd == fd) {
+			inst = mock_instances[i];
+			mock_instances[i] = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	if (inst) {
+		if (inst->num_jobs)
+			rk_info_msg("%s: %u jobs, %u controls, "
+					"waited %llu us\n",
+					inst->device->path, inst->num_jobs,
+					inst->num_controls,
+					(unsigned long long)
+					inst->total_wait_ns / 1000);
+		mock_queue_release(&inst->queues[MOCK_OUTPUT]);
+		mock_queue_release(&inst->queues[MOCK_CAPTURE]);
+		free(inst);
+	}
+
+	return close(fd);
+}
+
+/* The events ready of the queue, or when the earliest of them would be */
+static int16_t
+mock_queue_events(struct mock_queue *queue, int16_t events, uint64_t now,
+		uint64_t *wake_ns)
+{
+	struct mock_buffer *buffer;
+
+	if (0 == queue->count)
+		return 0;
+
+	buffer = &queue->buffers[queue->fifo[queue->head]];
+	if (0 == buffer->done_ns)
+		return 0;
+	if (buffer->done_ns <= now)
+		return events;
+
+	if (buffer->done_ns < *wake_ns)
+		*wake_ns = buffer->done_ns;
+
+	return 0;
+}
+
+static int32_t
+mock_poll(struct pollfd *fds, nfds_t nfds, int32_t timeout)
+{
+	uint64_t start = mock_now();
+	uint64_t now, wake_ns;
+	int32_t ready;
+
+	for (;;) {
+		now = mock_now();
+		wake_ns = UINT64_MAX;
+		ready = 0;
+
+		pthread_mutex_lock(&mock_lock);
+		for (nfds_t i = 0; i < nfds; i++) {
+			struct mock_instance *inst = mock_lookup(fds[i].fd);
+			int16_t revents;
+
+			if (NULL == inst) {
+				fds[i].revents = POLLNVAL;
+				ready++;
+				continue;
+			}
+
+			revents = mock_queue_events(
+					&inst->queues[MOCK_CAPTURE],
+					POLLIN | POLLRDNORM, now, &wake_ns);
+			revents |= mock_queue_events(
+					&inst->queues[MOCK_OUTPUT],
+					POLLOUT | POLLWRNORM, now, &wake_ns);
+			revents &= fds[i].events;
+			/* Nothing would ever be done */
+			if (0 == inst->queues[MOCK_CAPTURE].count
+					&& 0 == inst->queues[MOCK_OUTPUT].count)
+				revents |= POLLERR;
+
+			fds[i].revents = revents;
+			if (revents)
+				ready++;
+		}
+		pthread_mutex_unlock(&mock_lock);
+
+		if (ready || 0 == timeout)
+			return ready;
+
+		/* Another thread may queue a job in the meantime */
+		if (UINT64_MAX == wake_ns)
+			wake_ns = now + 1000000ull;
+		if (timeout > 0) {
+			uint64_t deadline = start + timeout * 1000000ull;
+
+			if (now >= deadline)
+				return 0;
+			if (wake_ns > deadline)
+				wake_ns = deadline;
+		}
+
+		mock_sleep(wake_ns - now);
+	}
+}
+
+static const struct rk_v4l2_backend rk_v4l2_mock = {
+	.name = "mock",
+	.devices = mock_device_paths,
+	/* The fds are not signaled by the jobs */
+	.pollable = false,
+	.open = mock_open,
+	.close = mock_close,
+	.ioctl = mock_ioctl,
+	.poll = mock_poll,
+};
+
+const struct rk_v4l2_backend *rk_v4l2_mock_backend(void)
+{
+	const char *latency = getenv("ROCKCHIP_VPU_MOCK_LATENCY_US");
+	const char *dump = getenv("ROCKCHIP_VPU_MOCK_DUMP");
+
+	pthread_mutex_lock(&mock_lock);
+	mock_latency_ns = (latency ? strtoull(latency, NULL, 10) :
+			MOCK_DEFAULT_LATENCY_US) * 1000ull;
+	if (dump && NULL == mock_dump) {
+		mock_dump = fopen(dump, "w");
+		if (NULL == mock_dump)
+			rk_error_msg("can't dump the controls to %s\n", dump);
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	rk_info_msg("using the mock VPU, %llu us a job\n",
+			(unsigned long long)mock_latency_ns / 1000);
+
+	return &rk_v4l2_mock;
+}
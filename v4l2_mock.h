@@ -0,0 +1,13 @@
+#ifndef _V4L2_MOCK_H_
+#define _V4L2_MOCK_H_
+#include "v4l2_utils.h"
+
+/*
+ * A VPU emulated in the process, to benchmark and test the driver on a
+ * machine without one. It is chosen by ROCKCHIP_VPU_MOCK in the
+ * environment, ROCKCHIP_VPU_MOCK_LATENCY_US is how long a job takes and
+ * ROCKCHIP_VPU_MOCK_DUMP names a file the submitted controls go to.
+ */
+const struct rk_v4l2_backend *rk_v4l2_mock_backend(void);
+
+#endif
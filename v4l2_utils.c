@@ -7,15 +7,51 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "rockchip_debug.h"
+#include "config.h"
+#ifdef HAVE_V4L2_MOCK
+#include "v4l2_mock.h"
+#endif
 
 #define SYS_PATH		"/sys/class/video4linux/"
 #define DEV_PATH		"/dev/"
 
+static int32_t rk_v4l2_kernel_open(const char *path, int32_t flags)
+{
+	return open(path, flags);
+}
+
+static int32_t
+rk_v4l2_kernel_ioctl(int32_t fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+static const struct rk_v4l2_backend rk_v4l2_kernel_backend = {
+	.name = "kernel",
+	.devices = NULL,
+	.pollable = true,
+	.open = rk_v4l2_kernel_open,
+	.close = close,
+	.ioctl = rk_v4l2_kernel_ioctl,
+	.poll = poll,
+};
+
+static const struct rk_v4l2_backend *rk_v4l2_backend = &rk_v4l2_kernel_backend;
+
+int32_t rk_v4l2_ioctl(int32_t fd, unsigned long request, void *arg)
+{
+	return rk_v4l2_backend->ioctl(fd, request, arg);
+}
+
 static bool 
 rk_v4l2_open(struct rk_v4l2_object *ctx, const char *device_path)
 {
-	int fd = open(device_path, O_RDWR /*| O_NONBLOCK*/ );
+	int fd = rk_v4l2_backend->open(device_path, O_RDWR /*| O_NONBLOCK*/ );
 
 	if (fd <= 0) {
 		return false;
@@ -62,20 +98,736 @@ rk_v4l2_open_by_name(struct rk_v4l2_object *ctx, const char *name)
 	return ret;
 }
 
+static uint32_t
+rk_v4l2_enum_formats(int32_t fd, uint32_t type, uint32_t *formats,
+		uint32_t max_formats, bool compressed)
+{
+	struct v4l2_fmtdesc fmtdesc;
+	uint32_t count = 0;
+
+	memset(&fmtdesc, 0, sizeof(fmtdesc));
+	fmtdesc.type = type;
+
+	while (count < max_formats
+			&& 0 == rk_v4l2_ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc)) {
+		if (compressed == !!(fmtdesc.flags & V4L2_FMT_FLAG_COMPRESSED))
+			formats[count++] = fmtdesc.pixelformat;
+		fmtdesc.index++;
+	}
+
+	return count;
+}
+
+static void
+rk_v4l2_probe_frame_size(int32_t fd, struct rk_v4l2_device_info *device)
+{
+	struct v4l2_frmsizeenum frmsize;
+
+	memset(&frmsize, 0, sizeof(frmsize));
+	frmsize.pixel_format = device->coded_formats[0];
+
+	if (rk_v4l2_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize))
+		return;
+
+	if (V4L2_FRMSIZE_TYPE_DISCRETE == frmsize.type) {
+		/* The last one is the largest */
+		do {
+			if (frmsize.discrete.width > device->max_width)
+				device->max_width = frmsize.discrete.width;
+			if (frmsize.discrete.height > device->max_height)
+				device->max_height = frmsize.discrete.height;
+			frmsize.index++;
+		} while (0 == rk_v4l2_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize));
+	}
+	else {
+		device->max_width = frmsize.stepwise.max_width;
+		device->max_height = frmsize.stepwise.max_height;
+	}
+}
+
+static void
+rk_v4l2_probe_controls(int32_t fd, struct rk_v4l2_device_info *device)
+{
+	struct v4l2_query_ext_ctrl query;
+
+	/* The first control the parser sets for a picture */
+	memset(&query, 0, sizeof(query));
+	if (device->is_encoder)
+		query.id = V4L2_CID_JPEG_QMATRIX;
+	else
+		query.id = V4L2_CID_MPEG_VIDEO_H264_SPS;
+
+	if (rk_v4l2_ioctl(fd, VIDIOC_QUERY_EXT_CTRL, &query))
+		return;
+
+	device->has_codec_controls = true;
+	device->max_reqs = query.max_reqs;
+}
+
+static bool
+rk_v4l2_probe_device(const char *path, struct rk_v4l2_device_info *device)
+{
+	struct v4l2_capability cap;
+	uint32_t caps;
+	int32_t fd;
+
+	fd = rk_v4l2_backend->open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	memset(device, 0, sizeof(*device));
+	memset(&cap, 0, sizeof(cap));
+	if (rk_v4l2_ioctl(fd, VIDIOC_QUERYCAP, &cap))
+		goto err;
+
+	caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+		cap.device_caps : cap.capabilities;
+	if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE))
+		goto err;
+
+	/* A decoder takes the bitstream, an encoder gives it */
+	device->num_coded_formats = rk_v4l2_enum_formats(fd,
+			V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			device->coded_formats, RK_V4L2_MAX_FORMATS, true);
+	if (device->num_coded_formats) {
+		device->num_raw_formats = rk_v4l2_enum_formats(fd,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				device->raw_formats, RK_V4L2_MAX_FORMATS,
+				false);
+	}
+	else {
+		device->is_encoder = true;
+		device->num_coded_formats = rk_v4l2_enum_formats(fd,
+				V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				device->coded_formats, RK_V4L2_MAX_FORMATS,
+				true);
+		device->num_raw_formats = rk_v4l2_enum_formats(fd,
+				V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+				device->raw_formats, RK_V4L2_MAX_FORMATS,
+				false);
+	}
+	/* A scaler or a color converter */
+	if (0 == device->num_coded_formats)
+		goto err;
+
+	snprintf(device->path, sizeof(device->path), "%s", path);
+	snprintf(device->card, sizeof(device->card), "%s",
+			(const char *)cap.card);
+	rk_v4l2_probe_frame_size(fd, device);
+	rk_v4l2_probe_controls(fd, device);
+
+	rk_v4l2_backend->close(fd);
+
+	rk_info_msg("%s: %s %s, %u coded formats, %ux%u at most\n",
+			device->path, device->card,
+			device->is_encoder ? "encoder" : "decoder",
+			device->num_coded_formats,
+			device->max_width, device->max_height);
+
+	return true;
+err:
+	rk_v4l2_backend->close(fd);
+	return false;
+}
+
+int32_t rk_v4l2_probe_devices(struct rk_v4l2_device_info *devices,
+		int32_t max_devices)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[32];
+	int32_t count = 0;
+
+#ifdef HAVE_V4L2_MOCK
+	if (getenv("ROCKCHIP_VPU_MOCK"))
+		rk_v4l2_backend = rk_v4l2_mock_backend();
+#endif
+	if (rk_v4l2_backend->devices) {
+		for (int32_t i = 0; rk_v4l2_backend->devices[i]
+				&& count < max_devices; i++)
+			if (rk_v4l2_probe_device(rk_v4l2_backend->devices[i],
+						&devices[count]))
+				count++;
+		return count;
+	}
+
+	dir = opendir(SYS_PATH);
+	if (NULL == dir)
+		return 0;
+
+	while (count < max_devices && (ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "video", 5))
+			continue;
+
+		snprintf(path, sizeof(path), DEV_PATH "%s", ent->d_name);
+		if (rk_v4l2_probe_device(path, &devices[count]))
+			count++;
+	}
+	closedir(dir);
+
+	return count;
+}
+
+bool rk_v4l2_device_has_format(const struct rk_v4l2_device_info *device,
+		uint32_t coded_format)
+{
+	for (uint32_t i = 0; i < device->num_coded_formats; i++)
+		if (device->coded_formats[i] == coded_format)
+			return true;
+
+	return false;
+}
+
+uint32_t rk_v4l2_pick_raw_format(const struct rk_v4l2_device_info *device)
+{
+	static const uint32_t formats[] = {
+		V4L2_PIX_FMT_NV12,
+		V4L2_PIX_FMT_NV12M,
+	};
+
+	for (uint32_t i = 0; i < ARRAY_ELEMS(formats); i++)
+		for (uint32_t j = 0; j < device->num_raw_formats; j++)
+			if (device->raw_formats[j] == formats[i])
+				return formats[i];
+
+	return V4L2_PIX_FMT_NV12;
+}
+
+const struct rk_v4l2_device_info *
+rk_v4l2_find_device(const struct rk_v4l2_device_info *devices,
+		int32_t num_devices, bool is_encoder, uint32_t coded_format)
+{
+	for (int32_t i = 0; i < num_devices; i++) {
+		if (devices[i].is_encoder != is_encoder)
+			continue;
+		if (rk_v4l2_device_has_format(&devices[i], coded_format))
+			return &devices[i];
+	}
+
+	return NULL;
+}
+
+static bool
+rk_v4l2_less_loaded(const struct rk_v4l2_device_load *a,
+		const struct rk_v4l2_device_load *b)
+{
+	if (a->num_pixels != b->num_pixels)
+		return a->num_pixels < b->num_pixels;
+	if (a->num_enqueued != b->num_enqueued)
+		return a->num_enqueued < b->num_enqueued;
+
+	return a->num_contexts < b->num_contexts;
+}
+
+int32_t rk_v4l2_select_device(const struct rk_v4l2_device_info *devices,
+		int32_t num_devices, bool is_encoder, uint32_t coded_format)
+{
+	int32_t best = -1;
+
+	for (int32_t i = 0; i < num_devices; i++) {
+		if (devices[i].is_encoder != is_encoder
+			|| !rk_v4l2_device_has_format(&devices[i],
+				coded_format))
+			continue;
+		if (best < 0 || rk_v4l2_less_loaded(&devices[i].load,
+					&devices[best].load))
+			best = i;
+	}
+
+	return best;
+}
+
+void rk_v4l2_device_reserve(struct rk_v4l2_device_load *load,
+		int64_t pixels)
+{
+	__sync_add_and_fetch(&load->num_contexts, 1);
+	__sync_add_and_fetch(&load->num_pixels, pixels);
+}
+
+void rk_v4l2_device_release(struct rk_v4l2_device_load *load,
+		int64_t pixels)
+{
+	__sync_sub_and_fetch(&load->num_contexts, 1);
+	__sync_sub_and_fetch(&load->num_pixels, pixels);
+}
+
+void rk_v4l2_set_device_load(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_device_load *load, int64_t pixels)
+{
+	ctx->load = load;
+	ctx->load_pixels = pixels;
+}
+
+/* The buffers the object has put in or got back from the node */
+static void rk_v4l2_account(struct rk_v4l2_object *ctx, int32_t delta)
+{
+	if (ctx->load && delta)
+		__sync_add_and_fetch(&ctx->load->num_enqueued, delta);
+}
+
+static void
+rk_v4l2_queue_push(struct rk_v4l2_queue *queue, struct rk_v4l2_buffer *buffer)
+{
+	buffer->state = BUFFER_FREE;
+	if (queue->free_slot[buffer->index] >= 0)
+		return;
+
+	queue->free_slot[buffer->index] = queue->num_free;
+	queue->free_list[queue->num_free++] = buffer->index;
+}
+
+static void
+rk_v4l2_queue_remove(struct rk_v4l2_queue *queue, struct rk_v4l2_buffer *buffer)
+{
+	int32_t slot = queue->free_slot[buffer->index];
+	int32_t last;
+
+	if (slot < 0)
+		return;
+
+	/* Fill the hole with the top of the stack */
+	last = queue->free_list[--queue->num_free];
+	queue->free_list[slot] = last;
+	queue->free_slot[last] = slot;
+	queue->free_slot[buffer->index] = -1;
+}
+
+static struct rk_v4l2_buffer *
+rk_v4l2_queue_peek(struct rk_v4l2_queue *queue)
+{
+	if (0 == queue->num_free)
+		return NULL;
+
+	return &queue->buffers[queue->free_list[queue->num_free - 1]];
+}
+
+static void
+rk_v4l2_queue_init(struct rk_v4l2_queue *queue,
+		struct rk_v4l2_buffer *buffers, int32_t count)
+{
+	queue->buffers = buffers;
+	queue->num_buffers = count;
+	queue->num_free = 0;
+	queue->num_enqueued = 0;
+	queue->done_head = 0;
+	queue->num_done = 0;
+
+	for (int32_t i = 0; i < VIDEO_MAX_FRAME; i++)
+		queue->free_slot[i] = -1;
+	/* The first buffer is on the top */
+	for (int32_t i = count; i > 0; i--)
+		rk_v4l2_queue_push(queue, &buffers[i - 1]);
+}
+
+static void
+rk_v4l2_queue_enqueued(struct rk_v4l2_queue *queue,
+		struct rk_v4l2_buffer *buffer)
+{
+	rk_v4l2_queue_remove(queue, buffer);
+	buffer->state = BUFFER_ENQUEUED;
+
+	queue->num_enqueued++;
+	if (queue->num_enqueued > queue->max_enqueued)
+		queue->max_enqueued = queue->num_enqueued;
+}
+
+static void
+rk_v4l2_queue_done_push(struct rk_v4l2_queue *queue,
+		struct rk_v4l2_buffer *buffer)
+{
+	queue->done_list[(queue->done_head + queue->num_done)
+		% VIDEO_MAX_FRAME] = buffer->index;
+	queue->num_done++;
+}
+
+static struct rk_v4l2_buffer *
+rk_v4l2_queue_done_pop(struct rk_v4l2_queue *queue)
+{
+	struct rk_v4l2_buffer *buffer;
+
+	if (0 == queue->num_done)
+		return NULL;
+
+	buffer = &queue->buffers[queue->done_list[queue->done_head]];
+	queue->done_head = (queue->done_head + 1) % VIDEO_MAX_FRAME;
+	queue->num_done--;
+
+	return buffer;
+}
+
+static void rk_v4l2_lock(struct rk_v4l2_object *ctx)
+{
+	if (ctx->completion)
+		pthread_mutex_lock(&ctx->completion->lock);
+}
+
+static void rk_v4l2_unlock(struct rk_v4l2_object *ctx)
+{
+	if (ctx->completion)
+		pthread_mutex_unlock(&ctx->completion->lock);
+}
+
+/* Wait for the completion thread to dequeue a buffer of the queue */
+static bool
+rk_v4l2_completion_wait(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_queue *queue, int32_t timeout_ms)
+{
+	struct rk_v4l2_completion *completion = ctx->completion;
+	struct timespec deadline;
+	bool ret;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&completion->lock);
+	if (0 == queue->num_done && queue->num_enqueued > 0 && timeout_ms)
+		queue->num_waits++;
+	while (0 == queue->num_done && queue->num_enqueued > 0
+			&& timeout_ms && !completion->quit) {
+		if (pthread_cond_timedwait(&completion->cond,
+					&completion->lock, &deadline)) {
+			queue->num_timeouts++;
+			break;
+		}
+	}
+	ret = queue->num_done > 0;
+	pthread_mutex_unlock(&completion->lock);
+
+	return ret;
+}
+
+static bool
+rk_v4l2_queue_wait(struct rk_v4l2_object *ctx, struct rk_v4l2_queue *queue,
+		int16_t events, int32_t timeout_ms)
+{
+	struct pollfd pfd;
+
+	if (ctx->completion)
+		return rk_v4l2_completion_wait(ctx, queue, timeout_ms);
+
+	/* The driver has nothing to give back */
+	if (0 == queue->num_enqueued)
+		return false;
+
+	pfd.fd = ctx->video_fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	queue->num_waits++;
+	if (rk_v4l2_backend->poll(&pfd, 1, timeout_ms) <= 0
+			|| !(pfd.revents & events)) {
+		queue->num_timeouts++;
+		return false;
+	}
+
+	return true;
+}
+
+static void
+rk_v4l2_queue_dump(const char *name, struct rk_v4l2_queue *queue)
+{
+	rk_info_msg("%s queue: %u acquired, %u waits, %u timeouts, "
+			"%d of %d enqueued at most\n", name,
+			queue->num_acquired, queue->num_waits,
+			queue->num_timeouts, queue->max_enqueued,
+			queue->num_buffers);
+}
+
+static void rk_v4l2_request_pool_init(struct rk_v4l2_request_pool *pool,
+		int32_t size)
+{
+	if (size <= 0 || size > RK_V4L2_MAX_REQUESTS)
+		size = RK_V4L2_MAX_REQUESTS;
+
+	memset(pool, 0, sizeof(*pool));
+	/* The lowest IDs are handed out first */
+	for (int32_t i = 0; i < size; i++)
+		pool->free_list[i] = size - i;
+	pool->num_free = size;
+	pool->size = size;
+}
+
+static void
+rk_v4l2_request_pool_put(struct rk_v4l2_request_pool *pool, uint16_t request)
+{
+	if (0 == request || request > pool->size
+			|| pool->num_free >= pool->size)
+		return;
+
+	pool->free_list[pool->num_free++] = request;
+}
+
+static void
+rk_v4l2_request_pool_dump(struct rk_v4l2_request_pool *pool)
+{
+	rk_info_msg("requests: %u allocated, %d of %d in flight at most\n",
+			pool->num_allocated, pool->max_in_flight,
+			pool->size);
+}
+
+/* 
+ * The node keeps the controls of max_reqs requests, the IDs beyond
+ * it are not handed out. Called before any request is allocated.
+ */
+void rk_v4l2_set_max_requests(struct rk_v4l2_object *ctx, uint32_t max_reqs)
+{
+	rk_v4l2_request_pool_init(&ctx->requests, max_reqs);
+}
+
+uint16_t rk_v4l2_request_alloc(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_buffer *buffer)
+{
+	struct rk_v4l2_request_pool *pool = &ctx->requests;
+	int32_t in_flight;
+
+	if (buffer->request)
+		return buffer->request;
+	if (0 == pool->num_free)
+		return 0;
+
+	buffer->request = pool->free_list[--pool->num_free];
+	pool->num_allocated++;
+	in_flight = pool->size - pool->num_free;
+	if (in_flight > pool->max_in_flight)
+		pool->max_in_flight = in_flight;
+
+	return buffer->request;
+}
+
+/* A bitstream buffer held by the application is given back */
+static void
+rk_v4l2_input_buffer_release(struct rk_v4l2_buffer *buffer, void *data)
+{
+	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
+
+	if (BUFFER_CLAIMED == buffer->state)
+		rk_v4l2_put_input_buffer(ctx, buffer);
+}
+
 static void rk_v4l2_input_release(struct rk_v4l2_object *ctx)
 {
 	struct v4l2_requestbuffers breq = { 0, 
-		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_MEMORY_MMAP };
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, ctx->input_memory };
 
-	ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq);
+	rk_v4l2_ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq);
 }
 
 static void rk_v4l2_output_release(struct rk_v4l2_object *ctx)
 {
 	struct v4l2_requestbuffers breq = { 0, 
-		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_MEMORY_MMAP };
+		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, ctx->output_memory };
 
-	ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq);
+	rk_v4l2_ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq);
+}
+
+/* 
+ * The buffers of a queue torn down while some of them are still
+ * referenced, they are freed when the last of those is released.
+ */
+struct rk_v4l2_orphans {
+	struct rk_v4l2_buffer *buffers;
+	int32_t count;
+	uint32_t memory;
+	uint32_t num_planes;
+	int32_t num_live;
+};
+
+static void
+rk_v4l2_buffers_free(struct rk_v4l2_buffer *buffers, int32_t count,
+		uint32_t memory, uint32_t num_planes)
+{
+	for (int32_t i = 0; i < count; i++) {
+		/* The imported memory belongs to the user */
+		if (V4L2_MEMORY_DMABUF == memory)
+			break;
+		for (uint32_t j = 0; j < num_planes; j++) {
+			if (NULL != buffers[i].plane[j].data)
+				munmap(buffers[i].plane[j].data,
+					buffers[i].plane[j].length);
+			if (buffers[i].plane[j].dma_fd >= 0)
+				close(buffers[i].plane[j].dma_fd);
+		}
+	}
+
+	free(buffers);
+}
+
+static void
+rk_v4l2_orphan_release(struct rk_v4l2_buffer *buffer, void *data)
+{
+	struct rk_v4l2_orphans *orphans = (struct rk_v4l2_orphans *)data;
+
+	buffer->release = NULL;
+	buffer->release_data = NULL;
+	if (--orphans->num_live > 0)
+		return;
+
+	rk_v4l2_buffers_free(orphans->buffers, orphans->count,
+			orphans->memory, orphans->num_planes);
+	free(orphans);
+}
+
+/* 
+ * Free the buffers of a queue, unless some are still referenced: they
+ * no longer belong to the object then, the last release frees them.
+ */
+static void
+rk_v4l2_buffers_drop(struct rk_v4l2_buffer *buffers, int32_t count,
+		uint32_t memory, uint32_t num_planes)
+{
+	struct rk_v4l2_orphans *orphans;
+	int32_t num_live = 0;
+
+	if (NULL == buffers)
+		return;
+
+	for (int32_t i = 0; i < count; i++)
+		if (buffers[i].ref_count > 0)
+			num_live++;
+
+	if (0 == num_live) {
+		rk_v4l2_buffers_free(buffers, count, memory, num_planes);
+		return;
+	}
+
+	orphans = malloc(sizeof(*orphans));
+	if (NULL == orphans) {
+		/* Leaked rather than freed under the users */
+		rk_error_msg("failed to keep %d referenced buffers\n",
+				num_live);
+		for (int32_t i = 0; i < count; i++)
+			buffers[i].release = NULL;
+		return;
+	}
+	orphans->buffers = buffers;
+	orphans->count = count;
+	orphans->memory = memory;
+	orphans->num_planes = num_planes;
+	orphans->num_live = num_live;
+
+	for (int32_t i = 0; i < count; i++) {
+		if (buffers[i].ref_count > 0) {
+			buffers[i].release = rk_v4l2_orphan_release;
+			buffers[i].release_data = orphans;
+		}
+		else {
+			buffers[i].release = NULL;
+			buffers[i].release_data = NULL;
+		}
+	}
+}
+
+static void rk_v4l2_input_unmap(struct rk_v4l2_object *ctx)
+{
+	struct v4l2_format *format = &ctx->input_format;
+
+	/* The slice data buffers of the application may still hold some */
+	rk_v4l2_buffers_drop(ctx->input_buffer, ctx->num_input_buffers,
+			ctx->input_memory, format->fmt.pix_mp.num_planes);
+	ctx->input_buffer = NULL;
+	ctx->num_input_buffers = 0;
+	/* The driver has dropped what was still queued */
+	rk_v4l2_account(ctx, -ctx->input_queue.num_enqueued);
+	rk_v4l2_queue_init(&ctx->input_queue, NULL, 0);
+	/* No frame is left in flight */
+	rk_v4l2_request_pool_init(&ctx->requests, ctx->requests.size);
+}
+
+static void rk_v4l2_output_unmap(struct rk_v4l2_object *ctx)
+{
+	struct v4l2_format *format = &ctx->output_format;
+
+	/* The images, the display and the exported buffers may hold some */
+	rk_v4l2_buffers_drop(ctx->output_buffer, ctx->num_output_buffers,
+			ctx->output_memory, format->fmt.pix_mp.num_planes);
+	ctx->output_buffer = NULL;
+	ctx->num_output_buffers = 0;
+	rk_v4l2_account(ctx, -ctx->output_queue.num_enqueued);
+	rk_v4l2_queue_init(&ctx->output_queue, NULL, 0);
+}
+
+/* The memory planes a raw format has, 1 for the coded ones */
+static uint32_t
+rk_v4l2_format_planes(uint32_t pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_NV12M:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+void rk_v4l2_buffer_set_layout(struct rk_v4l2_buffer *buffer,
+		const struct v4l2_format *format)
+{
+	const struct v4l2_pix_format_mplane *pix_mp = &format->fmt.pix_mp;
+
+	/* The pitches the driver chose, not the width */
+	switch (pix_mp->pixelformat) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV12M:
+		v4l2_bo_set_nv12_layout(buffer,
+				pix_mp->plane_fmt[0].bytesperline,
+				pix_mp->plane_fmt[pix_mp->num_planes - 1]
+				.bytesperline, pix_mp->height);
+		break;
+	default:
+		buffer->num_components = 0;
+		break;
+	}
+}
+
+bool rk_v4l2_buffer_fits_format(const struct rk_v4l2_buffer *buffer,
+		const struct v4l2_format *format)
+{
+	const struct v4l2_pix_format_mplane *pix_mp = &format->fmt.pix_mp;
+	struct rk_v4l2_buffer layout;
+
+	if (buffer->length != pix_mp->num_planes)
+		return false;
+	for (uint32_t i = 0; i < buffer->length; i++) {
+		if (buffer->plane[i].length < pix_mp->plane_fmt[i].sizeimage)
+			return false;
+	}
+
+	memset(&layout, 0, sizeof(layout));
+	layout.length = pix_mp->num_planes;
+	rk_v4l2_buffer_set_layout(&layout, format);
+	if (buffer->num_components != layout.num_components)
+		return false;
+
+	/* The VPU takes a dma-buf from its start, in its own pitches */
+	for (uint32_t i = 0; i < layout.num_components; i++) {
+		if (buffer->component[i].plane != layout.component[i].plane
+			|| buffer->component[i].offset
+			!= layout.component[i].offset
+			|| buffer->component[i].pitch
+			!= layout.component[i].pitch)
+			return false;
+	}
+
+	return true;
+}
+
+/* No memory until it is exported or the user attaches its dma-bufs */
+static void
+rk_v4l2_import_init(struct rk_v4l2_buffer *buffers, int32_t count,
+		const struct v4l2_format *format)
+{
+	for (int32_t i = 0; i < count; i++) {
+		for (int32_t j = 0; j < RK_VIDEO_MAX_PLANES; j++)
+			buffers[i].plane[j].dma_fd = -1;
+		buffers[i].state = BUFFER_FREE;
+		buffers[i].index = i;
+		buffers[i].length = format->fmt.pix_mp.num_planes;
+		rk_v4l2_buffer_set_layout(&buffers[i], format);
+	}
 }
 
 static int32_t rk_v4l2_input_allocate
@@ -83,7 +835,7 @@ static int32_t rk_v4l2_input_allocate
 {
 	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
 	struct v4l2_requestbuffers breq = { count, 
-		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_MEMORY_MMAP };
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, ctx->input_memory };
 	struct v4l2_buffer buffer;
 	struct v4l2_exportbuffer expbuf;
 	struct v4l2_format *format = &ctx->input_format;
@@ -91,7 +843,7 @@ static int32_t rk_v4l2_input_allocate
 
 	rk_v4l2_input_release(ctx);
 
-	if (ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq) < 0) {
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq) < 0) {
 		rk_info_msg("Allocate failed\n");
 		return 0;
 	}
@@ -109,6 +861,19 @@ static int32_t rk_v4l2_input_allocate
 		return 0;
 	}
 	ctx->num_input_buffers = breq.count;
+	rk_v4l2_import_init(ctx->input_buffer, breq.count, format);
+
+	if (V4L2_MEMORY_DMABUF == ctx->input_memory) {
+		for (int32_t i = 0; i < breq.count; i++) {
+			ctx->input_buffer[i].release =
+				rk_v4l2_input_buffer_release;
+			ctx->input_buffer[i].release_data = ctx;
+		}
+		rk_v4l2_queue_init(&ctx->input_queue, ctx->input_buffer,
+				breq.count);
+
+		return breq.count;
+	}
 
 	memset(&expbuf, 0, sizeof(expbuf));
 	memset(&buffer, 0, sizeof(buffer));
@@ -125,44 +890,37 @@ static int32_t rk_v4l2_input_allocate
 	for (int32_t i = 0; i < breq.count; i++) {
 		buffer.index = i;
 
-		 if (ioctl(ctx->video_fd, VIDIOC_QUERYBUF, &buffer) < 0) {
+		 if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_QUERYBUF, &buffer) < 0) {
 			 rk_error_msg("Query of input buffer failed\n");
 			 return 0;
 		 }
 
 		expbuf.index = i;
 		for (int32_t j = 0; j < format->fmt.pix_mp.num_planes; j++) {
-			void *ptr = NULL;
 			expbuf.plane = j;
 
-			if (ioctl(ctx->video_fd, VIDIOC_EXPBUF, &expbuf) < 0) 
+			if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_EXPBUF, &expbuf) < 0) 
 			{
 				rk_error_msg
 					("Export of output buffer failed\n");
 				return i;
 			}
 
-			ptr = mmap(NULL, buffer.m.planes[j].length,
-					 PROT_READ | PROT_WRITE,
-					 MAP_SHARED,
-					 expbuf.fd,
-					 0);
-
-			if (ptr == MAP_FAILED) {
-				rk_error_msg("Failed to map input buffer");
-			}
+			/* Mapped by v4l2_bo_map() at the first CPU access */
 			ctx->input_buffer[i].plane[j].length =
 				 buffer.m.planes[j].length;
-			ctx->input_buffer[i].plane[j].data = ptr;
+			ctx->input_buffer[i].plane[j].data = NULL;
 			ctx->input_buffer[i].plane[j].dma_fd = expbuf.fd;
 
 		}
 		ctx->input_buffer[i].state = BUFFER_FREE;
 		ctx->input_buffer[i].index = i;
 		ctx->input_buffer[i].length = format->fmt.pix_mp.num_planes;
+		ctx->input_buffer[i].release = rk_v4l2_input_buffer_release;
+		ctx->input_buffer[i].release_data = ctx;
 
 	}
-	ctx->has_free_input_buffers = breq.count;
+	rk_v4l2_queue_init(&ctx->input_queue, ctx->input_buffer, breq.count);
 
 	return breq.count;
 }
@@ -172,7 +930,7 @@ static int32_t rk_v4l2_output_allocate
 {
 	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
 	struct v4l2_requestbuffers breq = { count, 
-		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_MEMORY_MMAP };
+		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, ctx->output_memory };
 	struct v4l2_exportbuffer expbuf;
 	struct v4l2_format *format = &ctx->output_format;
 	struct v4l2_buffer buffer;
@@ -181,7 +939,7 @@ static int32_t rk_v4l2_output_allocate
 
 	rk_v4l2_output_release(ctx);
 
-	ret = ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq);
+	ret = rk_v4l2_ioctl(ctx->video_fd, VIDIOC_REQBUFS, &breq);
 	if (ret < 0) {
 		rk_info_msg("Allocate failed\n");
 		return 0;
@@ -201,6 +959,14 @@ static int32_t rk_v4l2_output_allocate
 	}
 
 	ctx->num_output_buffers = breq.count;
+	rk_v4l2_import_init(ctx->output_buffer, breq.count, format);
+
+	if (V4L2_MEMORY_DMABUF == ctx->output_memory) {
+		rk_v4l2_queue_init(&ctx->output_queue, ctx->output_buffer,
+				breq.count);
+
+		return breq.count;
+	}
 
 	memset(&expbuf, 0, sizeof(expbuf));
 	memset(&buffer, 0, sizeof(buffer));
@@ -217,7 +983,7 @@ static int32_t rk_v4l2_output_allocate
 	for (int32_t i = 0; i < breq.count; i++) {
 		buffer.index = i;
 
-		 if (ioctl(ctx->video_fd, VIDIOC_QUERYBUF, &buffer) < 0) {
+		 if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_QUERYBUF, &buffer) < 0) {
 			 rk_error_msg("Query of output buffer failed\n");
 			 return 0;
 		 }
@@ -225,36 +991,25 @@ static int32_t rk_v4l2_output_allocate
 		expbuf.index = i;
 
 		for (int32_t j = 0; j < format->fmt.pix_mp.num_planes; j++) {
-			void *ptr = NULL;
-
 			expbuf.plane = j;
-			if (ioctl(ctx->video_fd, VIDIOC_EXPBUF, &expbuf) < 0) 
+			if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_EXPBUF, &expbuf) < 0) 
 			{
 				rk_error_msg
 					("Export of output buffer failed\n");
 				return i;
 			}
 
-			ptr = mmap(NULL, buffer.m.planes[j].length,
-					 PROT_READ | PROT_WRITE,
-					 MAP_SHARED,
-					 expbuf.fd,
-					 0);
-
-			 if (ptr == MAP_FAILED) {
-				 rk_error_msg("Failed to map output buffer\n");
-			 }
-
+			/* Mapped by v4l2_bo_map() at the first CPU access */
 			ctx->output_buffer[i].plane[j].length =
 				 buffer.m.planes[j].length;
-			ctx->output_buffer[i].plane[j].data = ptr;
+			ctx->output_buffer[i].plane[j].data = NULL;
 			ctx->output_buffer[i].plane[j].dma_fd = expbuf.fd;
 		}
 		ctx->output_buffer[i].state = BUFFER_FREE;
 		ctx->output_buffer[i].index = i;
 		ctx->output_buffer[i].length = format->fmt.pix_mp.num_planes;
 	}
-	ctx->has_free_output_buffers = breq.count;
+	rk_v4l2_queue_init(&ctx->output_queue, ctx->output_buffer, breq.count);
 
 	return breq.count;
 }
@@ -262,21 +1017,56 @@ static int32_t rk_v4l2_output_allocate
 struct rk_v4l2_buffer *
 rk_v4l2_get_input_buffer(struct rk_v4l2_object *ctx)
 {
-	for (uint32_t i = 0; i < ctx->num_input_buffers; i++) {
-		if (BUFFER_FREE == ctx->input_buffer[i].state)
-			return &ctx->input_buffer[i];
-	}
-	return NULL;
+	return rk_v4l2_queue_peek(&ctx->input_queue);
 }
 
 struct rk_v4l2_buffer *
 rk_v4l2_get_output_buffer(struct rk_v4l2_object *ctx)
 {
-	for (uint32_t i = 0; i < ctx->num_output_buffers; i++) {
-		if (BUFFER_FREE == ctx->output_buffer[i].state)
-			return &ctx->output_buffer[i];
+	return rk_v4l2_queue_peek(&ctx->output_queue);
+}
+
+struct rk_v4l2_buffer *
+rk_v4l2_acquire_input_buffer(struct rk_v4l2_object *ctx, int32_t timeout_ms)
+{
+	struct rk_v4l2_queue *queue = &ctx->input_queue;
+	struct rk_v4l2_buffer *buffer;
+
+	buffer = rk_v4l2_queue_peek(queue);
+	/* The bitstream buffers done by the driver are ready to write */
+	while (NULL == buffer && timeout_ms
+		&& rk_v4l2_queue_wait(ctx, queue, POLLOUT, timeout_ms)) {
+		if (ctx->ops.dqbuf_input(ctx, &buffer))
+			return NULL;
+		buffer = rk_v4l2_queue_peek(queue);
 	}
-	return NULL;
+	if (NULL == buffer)
+		return NULL;
+
+	rk_v4l2_queue_remove(queue, buffer);
+	buffer->state = BUFFER_FILLED;
+	buffer->plane[0].bytesused = 0;
+	queue->num_acquired++;
+
+	return buffer;
+}
+
+void rk_v4l2_put_input_buffer(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_buffer *buffer)
+{
+	/* 
+	 * The ID is free again, but it is not reinitialized: the node
+	 * still holds the controls last set with it.
+	 */
+	rk_v4l2_request_pool_put(&ctx->requests, buffer->request);
+	buffer->request = 0;
+	buffer->plane[0].bytesused = 0;
+	rk_v4l2_queue_push(&ctx->input_queue, buffer);
+}
+
+bool rk_v4l2_wait_output_buffer(struct rk_v4l2_object *ctx, int32_t timeout_ms)
+{
+	return rk_v4l2_queue_wait(ctx, &ctx->output_queue, POLLIN, timeout_ms);
 }
 
 int32_t
@@ -291,6 +1081,28 @@ rk_v4l2_buffer_total_bytesused(struct rk_v4l2_buffer *buffer)
 	return ret;
 }
 
+/* 
+ * Only wait for the queues with buffers in the driver, the fd is
+ * disarmed once it fires so an idle device doesn't keep waking us.
+ */
+static void rk_v4l2_completion_arm(struct rk_v4l2_object *ctx)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	if (ctx->output_queue.num_enqueued > 0)
+		event.events |= EPOLLIN;
+	if (ctx->input_queue.num_enqueued > 0)
+		event.events |= EPOLLOUT;
+	if (0 == event.events)
+		return;
+
+	event.events |= EPOLLONESHOT;
+	event.data.fd = ctx->video_fd;
+	epoll_ctl(ctx->completion->epoll_fd, EPOLL_CTL_MOD, ctx->video_fd,
+			&event);
+}
+
 static int32_t rk_v4l2_qbuf_input
 (void *data, struct rk_v4l2_buffer *buffer)
 {
@@ -305,24 +1117,32 @@ static int32_t rk_v4l2_qbuf_input
 	memset(planes, 0, sizeof(planes));
 
 	qbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	qbuf.memory = V4L2_MEMORY_MMAP;
+	qbuf.memory = ctx->input_memory;
 	qbuf.index = buffer->index;
 	qbuf.length = format->fmt.pix_mp.num_planes;
 	qbuf.m.planes = planes;
-	qbuf.request = buffer->index;
+	qbuf.request = buffer->request;
 
 	for(uint32_t i = 0; i < format->fmt.pix_mp.num_planes; i++){
 		planes[i].bytesused = buffer->plane[i].bytesused;
 		planes[i].length = buffer->plane[i].length;
+		if (V4L2_MEMORY_DMABUF == ctx->input_memory)
+			planes[i].m.fd = buffer->plane[i].dma_fd;
 	}
 
-	if (ioctl(ctx->video_fd, VIDIOC_QBUF, &qbuf)) {
+	rk_v4l2_lock(ctx);
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_QBUF, &qbuf)) {
+		rk_v4l2_unlock(ctx);
 		rk_info_msg("Enqueuing of input buffer %d failed: %s\n", 
 				buffer->index, strerror(errno));
 		return -1;
 	}
 
-	buffer->state = BUFFER_ENQUEUED;
+	rk_v4l2_queue_enqueued(&ctx->input_queue, buffer);
+	rk_v4l2_account(ctx, 1);
+	if (ctx->completion)
+		rk_v4l2_completion_arm(ctx);
+	rk_v4l2_unlock(ctx);
 
 	return 0;
 }
@@ -341,26 +1161,38 @@ static int32_t rk_v4l2_qbuf_output
 	memset(planes, 0, sizeof(planes));
 
 	qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	qbuf.memory = V4L2_MEMORY_MMAP;
+	qbuf.memory = ctx->output_memory;
 	qbuf.index = buffer->index;
 	qbuf.length = format->fmt.pix_mp.num_planes;
 	qbuf.m.planes = planes;
 
-	if (ioctl(ctx->video_fd, VIDIOC_QBUF, &qbuf) < 0) {
+	if (V4L2_MEMORY_DMABUF == ctx->output_memory) {
+		for (uint32_t i = 0; i < format->fmt.pix_mp.num_planes; i++) {
+			planes[i].m.fd = buffer->plane[i].dma_fd;
+			planes[i].length = buffer->plane[i].length;
+		}
+	}
+
+	rk_v4l2_lock(ctx);
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_QBUF, &qbuf) < 0) {
+		rk_v4l2_unlock(ctx);
 		rk_info_msg("Enqueuing of output buffer %d failed: %s\n",
 				buffer->index, strerror(errno));
 		return -1;
 	}
 
-	buffer->state = BUFFER_ENQUEUED;
+	rk_v4l2_queue_enqueued(&ctx->output_queue, buffer);
+	rk_v4l2_account(ctx, 1);
+	if (ctx->completion)
+		rk_v4l2_completion_arm(ctx);
+	rk_v4l2_unlock(ctx);
 
 	return 0;
 }
 
-static int32_t rk_v4l2_dqbuf_input
-(void *data, struct rk_v4l2_buffer **buffer)
+static int32_t rk_v4l2_dequeue_input
+(struct rk_v4l2_object *ctx, struct rk_v4l2_buffer **buffer)
 {
-	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
 	struct v4l2_buffer dqbuf;
 	struct v4l2_plane planes[RK_VIDEO_MAX_PLANES];
 	struct v4l2_format *format;
@@ -371,29 +1203,28 @@ static int32_t rk_v4l2_dqbuf_input
 	memset(planes, 0, sizeof(planes));
 
 	dqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	dqbuf.memory = V4L2_MEMORY_MMAP;
+	dqbuf.memory = ctx->input_memory;
 	dqbuf.length = format->fmt.pix_mp.num_planes;
 	dqbuf.m.planes = planes;
 
-	if (ioctl(ctx->video_fd, VIDIOC_DQBUF, &dqbuf) < 0) {
-		rk_info_msg("dequeuing of input buffer failed: %s",
-				strerror(errno));
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_DQBUF, &dqbuf) < 0) {
+		/* Nothing done yet for the completion thread */
+		if (EAGAIN != errno)
+			rk_info_msg("dequeuing of input buffer failed: %s",
+					strerror(errno));
 		return -1;
 	}
 
 	*buffer = &ctx->input_buffer[dqbuf.index];
-	/* FIXME */
-	(*buffer)->plane[0].bytesused = 0;
-	/* After dequeue, I think it won't be used anymore */
-	(*buffer)->state = BUFFER_FREE;
+	ctx->input_queue.num_enqueued--;
+	rk_v4l2_account(ctx, -1);
 	
 	return 0;
 }
 
-static int32_t rk_v4l2_dqbuf_output
-(void *data, struct rk_v4l2_buffer **buffer)
+static int32_t rk_v4l2_dequeue_output
+(struct rk_v4l2_object *ctx, struct rk_v4l2_buffer **buffer)
 {
-	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
 	struct v4l2_buffer dqbuf;
 	struct v4l2_plane planes[RK_VIDEO_MAX_PLANES];
 	struct v4l2_format *format;
@@ -404,17 +1235,20 @@ static int32_t rk_v4l2_dqbuf_output
 	memset(planes, 0, sizeof(planes));
 
 	dqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	dqbuf.memory = V4L2_MEMORY_MMAP;
+	dqbuf.memory = ctx->output_memory;
 	dqbuf.length = format->fmt.pix_mp.num_planes;
 	dqbuf.m.planes = planes;
 
-	if (ioctl(ctx->video_fd, VIDIOC_DQBUF, &dqbuf) < 0) {
-		rk_info_msg("dequeuing of output buffer failed: %s\n",
-				strerror(errno));
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_DQBUF, &dqbuf) < 0) {
+		if (EAGAIN != errno)
+			rk_info_msg("dequeuing of output buffer failed: %s\n",
+					strerror(errno));
 		return -1;
 	}
 
 	*buffer = &(ctx->output_buffer[dqbuf.index]);
+	ctx->output_queue.num_enqueued--;
+	rk_v4l2_account(ctx, -1);
 
 	for(uint32_t i = 0; i < format->fmt.pix_mp.num_planes; i++) {
 		(*buffer)->plane[i].bytesused = dqbuf.m.planes[i].bytesused;
@@ -425,6 +1259,202 @@ static int32_t rk_v4l2_dqbuf_output
 	return 0;
 }
 
+/* A buffer the completion thread has dequeued, wait if none yet */
+static int32_t
+rk_v4l2_collect(struct rk_v4l2_object *ctx, struct rk_v4l2_queue *queue,
+		struct rk_v4l2_buffer **buffer)
+{
+	struct rk_v4l2_completion *completion = ctx->completion;
+
+	pthread_mutex_lock(&completion->lock);
+	while (0 == queue->num_done && queue->num_enqueued > 0
+			&& !completion->quit)
+		pthread_cond_wait(&completion->cond, &completion->lock);
+	*buffer = rk_v4l2_queue_done_pop(queue);
+	pthread_mutex_unlock(&completion->lock);
+
+	return NULL == *buffer ? -1 : 0;
+}
+
+static int32_t rk_v4l2_dqbuf_input
+(void *data, struct rk_v4l2_buffer **buffer)
+{
+	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
+	int32_t ret;
+
+	if (ctx->completion)
+		ret = rk_v4l2_collect(ctx, &ctx->input_queue, buffer);
+	else
+		ret = rk_v4l2_dequeue_input(ctx, buffer);
+	if (ret)
+		return ret;
+
+	/* After dequeue, I think it won't be used anymore */
+	rk_v4l2_put_input_buffer(ctx, *buffer);
+
+	return 0;
+}
+
+static int32_t rk_v4l2_dqbuf_output
+(void *data, struct rk_v4l2_buffer **buffer)
+{
+	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
+
+	if (ctx->completion)
+		return rk_v4l2_collect(ctx, &ctx->output_queue, buffer);
+
+	return rk_v4l2_dequeue_output(ctx, buffer);
+}
+
+static void *rk_v4l2_completion_thread(void *data)
+{
+	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
+	struct rk_v4l2_completion *completion = ctx->completion;
+	struct epoll_event events[2];
+	struct rk_v4l2_buffer *buffer;
+	uint32_t ready;
+	int32_t n;
+
+	for (;;) {
+		n = epoll_wait(completion->epoll_fd, events, 2, -1);
+		if (n < 0 && EINTR != errno) {
+			rk_error_msg("completion thread: %s\n", strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&completion->lock);
+		if (completion->quit) {
+			pthread_mutex_unlock(&completion->lock);
+			break;
+		}
+
+		ready = 0;
+		for (int32_t i = 0; i < n; i++)
+			if (events[i].data.fd == ctx->video_fd)
+				ready |= events[i].events;
+
+		if (ready & EPOLLIN)
+			while (ctx->output_queue.num_enqueued > 0
+				&& 0 == rk_v4l2_dequeue_output(ctx, &buffer))
+				rk_v4l2_queue_done_push(&ctx->output_queue,
+						buffer);
+		if (ready & EPOLLOUT)
+			while (ctx->input_queue.num_enqueued > 0
+				&& 0 == rk_v4l2_dequeue_input(ctx, &buffer))
+				rk_v4l2_queue_done_push(&ctx->input_queue,
+						buffer);
+		completion->num_wakeups++;
+		pthread_cond_broadcast(&completion->cond);
+
+		/* An error alone waits for the next QBUF to re-arm */
+		if (ready & (EPOLLIN | EPOLLOUT))
+			rk_v4l2_completion_arm(ctx);
+		pthread_mutex_unlock(&completion->lock);
+	}
+
+	return NULL;
+}
+
+bool rk_v4l2_start_completion(struct rk_v4l2_object *ctx)
+{
+	struct rk_v4l2_completion *completion;
+	struct epoll_event event;
+	int32_t flags;
+
+	if (NULL != ctx->completion)
+		return true;
+	/* The mock VPU can't be waited on by epoll */
+	if (!rk_v4l2_backend->pollable)
+		return false;
+
+	completion = calloc(1, sizeof(*completion));
+	if (NULL == completion)
+		return false;
+
+	completion->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	completion->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (completion->epoll_fd < 0 || completion->event_fd < 0)
+		goto err;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = completion->event_fd;
+	if (epoll_ctl(completion->epoll_fd, EPOLL_CTL_ADD,
+				completion->event_fd, &event))
+		goto err;
+
+	/* Disarmed until a buffer is queued */
+	event.events = EPOLLONESHOT;
+	event.data.fd = ctx->video_fd;
+	if (epoll_ctl(completion->epoll_fd, EPOLL_CTL_ADD,
+				ctx->video_fd, &event))
+		goto err;
+
+	/* The thread must not sleep in DQBUF with the lock held */
+	flags = fcntl(ctx->video_fd, F_GETFL);
+	fcntl(ctx->video_fd, F_SETFL, flags | O_NONBLOCK);
+
+	pthread_mutex_init(&completion->lock, NULL);
+	pthread_cond_init(&completion->cond, NULL);
+
+	pthread_mutex_lock(&completion->lock);
+	ctx->completion = completion;
+	if (pthread_create(&completion->thread, NULL,
+				rk_v4l2_completion_thread, ctx)) {
+		ctx->completion = NULL;
+		pthread_mutex_unlock(&completion->lock);
+		pthread_cond_destroy(&completion->cond);
+		pthread_mutex_destroy(&completion->lock);
+		fcntl(ctx->video_fd, F_SETFL, flags);
+		goto err;
+	}
+	rk_v4l2_completion_arm(ctx);
+	pthread_mutex_unlock(&completion->lock);
+
+	return true;
+err:
+	rk_error_msg("Failed to start the completion thread\n");
+	if (completion->epoll_fd >= 0)
+		close(completion->epoll_fd);
+	if (completion->event_fd >= 0)
+		close(completion->event_fd);
+	free(completion);
+	return false;
+}
+
+void rk_v4l2_stop_completion(struct rk_v4l2_object *ctx)
+{
+	struct rk_v4l2_completion *completion = ctx->completion;
+	uint64_t quit = 1;
+	int32_t flags;
+
+	if (NULL == completion)
+		return;
+
+	pthread_mutex_lock(&completion->lock);
+	completion->quit = true;
+	pthread_cond_broadcast(&completion->cond);
+	pthread_mutex_unlock(&completion->lock);
+
+	if (write(completion->event_fd, &quit, sizeof(quit)) < 0)
+		rk_error_msg("Failed to wake the completion thread\n");
+	pthread_join(completion->thread, NULL);
+
+	rk_info_msg("completion thread: %u wakeups\n",
+			completion->num_wakeups);
+
+	/* The callers dequeue by themselves again */
+	flags = fcntl(ctx->video_fd, F_GETFL);
+	fcntl(ctx->video_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+	ctx->completion = NULL;
+	close(completion->epoll_fd);
+	close(completion->event_fd);
+	pthread_cond_destroy(&completion->cond);
+	pthread_mutex_destroy(&completion->lock);
+	free(completion);
+}
+
 static int32_t 
 rk_v4l2_dec_set_codec(void *data, uint32_t codec_type) 
 {
@@ -435,11 +1465,12 @@ rk_v4l2_dec_set_codec(void *data, uint32_t codec_type)
 
 	format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	format.fmt.pix_mp.pixelformat = codec_type;
-	format.fmt.pix_mp.plane_fmt[0].sizeimage = MAX_CODEC_BUFFER;
+	format.fmt.pix_mp.plane_fmt[0].sizeimage = ctx->bitstream_size ?
+		ctx->bitstream_size : MAX_CODEC_BUFFER;
 	format.fmt.pix_mp.num_planes = 1;
 	ctx->input_format = format;
 
-	return (ioctl(ctx->video_fd, VIDIOC_S_FMT, &format));
+	return (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_S_FMT, &format));
 }
 
 static int32_t 
@@ -447,17 +1478,23 @@ rk_v4l2_dec_set_fmt(void *data, uint32_t reversed)
 {
 	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
 	struct v4l2_format format;
+	int32_t ret;
 
 	memset(&format, 0, sizeof(format));
 
 	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	format.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
+	format.fmt.pix_mp.pixelformat = ctx->raw_format ?
+		ctx->raw_format : V4L2_PIX_FMT_NV12;
 	format.fmt.pix_mp.width = ctx->input_size.w;
 	format.fmt.pix_mp.height = ctx->input_size.h;
-	format.fmt.pix_mp.num_planes = 1;
+	format.fmt.pix_mp.num_planes =
+		rk_v4l2_format_planes(format.fmt.pix_mp.pixelformat);
+
+	/* Keep the size of a picture the driver needs */
+	ret = rk_v4l2_ioctl(ctx->video_fd, VIDIOC_S_FMT, &format);
 	ctx->output_format = format;
 
-	return (ioctl(ctx->video_fd, VIDIOC_S_FMT, &format));
+	return ret;
 }
 
 static int32_t 
@@ -470,11 +1507,12 @@ rk_v4l2_enc_set_codec(void *data, uint32_t codec_type)
 
 	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	format.fmt.pix_mp.pixelformat = codec_type;
-	format.fmt.pix_mp.plane_fmt[0].sizeimage = MAX_CODEC_BUFFER;
+	format.fmt.pix_mp.plane_fmt[0].sizeimage = ctx->bitstream_size ?
+		ctx->bitstream_size : MAX_CODEC_BUFFER;
 	format.fmt.pix_mp.num_planes = 1;
 	ctx->output_format = format;
 
-	return (ioctl(ctx->video_fd, VIDIOC_S_FMT, &format));
+	return (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_S_FMT, &format));
 }
 
 static int32_t 
@@ -482,29 +1520,35 @@ rk_v4l2_enc_set_fmt(void *data, uint32_t reversed)
 {
 	struct rk_v4l2_object *ctx = (struct rk_v4l2_object *)data;
 	struct v4l2_format format;
+	int32_t ret;
 
 	memset(&format, 0, sizeof(format));
 
 	format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	format.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
+	format.fmt.pix_mp.pixelformat = ctx->raw_format ?
+		ctx->raw_format : V4L2_PIX_FMT_NV12;
 	format.fmt.pix_mp.width = ctx->input_size.w;
 	format.fmt.pix_mp.height = ctx->input_size.h;
-	format.fmt.pix_mp.num_planes = 1;
+	format.fmt.pix_mp.num_planes =
+		rk_v4l2_format_planes(format.fmt.pix_mp.pixelformat);
+
+	/* Keep the size of a picture the driver needs */
+	ret = rk_v4l2_ioctl(ctx->video_fd, VIDIOC_S_FMT, &format);
 	ctx->input_format = format;
 
-	return (ioctl(ctx->video_fd, VIDIOC_S_FMT, &format));
+	return ret;
 }
 
 bool rk_v4l2_streamon_all(struct rk_v4l2_object *ctx)
 {
 	int32_t type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	if (ioctl(ctx->video_fd, VIDIOC_STREAMON, &type) < 0)
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMON, &type) < 0)
 		return false;
 	else
 		ctx->input_streamon = true;
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (ioctl(ctx->video_fd, VIDIOC_STREAMON, &type) < 0)
+	if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMON, &type) < 0)
 		return false;
 	else
 		ctx->output_streamon = true;
@@ -512,6 +1556,113 @@ bool rk_v4l2_streamon_all(struct rk_v4l2_object *ctx)
 	return true;
 };
 
+/* 
+ * Reallocate the bitstream buffers of a decoder with a new size,
+ * none of them could be in the driver.
+ */
+int32_t rk_v4l2_dec_resize_input(struct rk_v4l2_object *ctx, uint32_t size)
+{
+	int32_t type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	uint32_t codec_type = ctx->input_format.fmt.pix_mp.pixelformat;
+	uint32_t count = ctx->num_input_buffers;
+	bool streamon = ctx->input_streamon;
+
+	/* The completion thread must not touch the old buffers */
+	rk_v4l2_lock(ctx);
+	if (streamon) {
+		if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMOFF, &type) < 0) {
+			rk_info_msg("Streamoff failed on input");
+			count = 0;
+			goto out;
+		}
+		ctx->input_streamon = false;
+	}
+
+	rk_v4l2_input_unmap(ctx);
+	rk_v4l2_input_release(ctx);
+
+	ctx->bitstream_size = size;
+	if (ctx->ops.set_codec(ctx, codec_type) < 0) {
+		rk_error_msg("Failed to set the bitstream size %u\n", size);
+		count = 0;
+		goto out;
+	}
+
+	count = ctx->ops.input_alloc(ctx, count);
+
+	if (streamon && count) {
+		if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMON, &type) < 0)
+			count = 0;
+		else
+			ctx->input_streamon = true;
+	}
+out:
+	rk_v4l2_unlock(ctx);
+
+	return count;
+}
+
+/* 
+ * Reallocate the picture buffers of a decoder, they are all
+ * dropped from the driver.
+ */
+int32_t rk_v4l2_dec_resize_output(struct rk_v4l2_object *ctx, uint32_t count)
+{
+	int32_t type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	bool streamon = ctx->output_streamon;
+
+	rk_v4l2_lock(ctx);
+	if (streamon) {
+		if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMOFF, &type) < 0) {
+			rk_v4l2_unlock(ctx);
+			rk_info_msg("Streamoff failed on output");
+			return 0;
+		}
+		ctx->output_streamon = false;
+	}
+
+	rk_v4l2_output_unmap(ctx);
+
+	/* It would release the old ones first */
+	count = ctx->ops.output_alloc(ctx, count);
+
+	if (streamon && count) {
+		if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMON, &type) < 0)
+			count = 0;
+		else
+			ctx->output_streamon = true;
+	}
+	rk_v4l2_unlock(ctx);
+
+	return count;
+}
+
+/* Drop all the buffers of a queue, the new ones would use the memory */
+void rk_v4l2_set_input_memory(struct rk_v4l2_object *ctx, uint32_t memory)
+{
+	rk_v4l2_input_unmap(ctx);
+	rk_v4l2_input_release(ctx);
+	ctx->input_memory = memory;
+}
+
+void rk_v4l2_set_output_memory(struct rk_v4l2_object *ctx, uint32_t memory)
+{
+	rk_v4l2_output_unmap(ctx);
+	rk_v4l2_output_release(ctx);
+	ctx->output_memory = memory;
+}
+
+void rk_v4l2_buffer_attach(struct rk_v4l2_buffer *buffer,
+		const struct rk_v4l2_buffer *src)
+{
+	for (uint32_t i = 0; i < buffer->length && i < src->length; i++) {
+		buffer->plane[i].dma_fd = src->plane[i].dma_fd;
+		buffer->plane[i].length = src->plane[i].length;
+		buffer->plane[i].data = src->plane[i].data;
+		buffer->plane[i].bytesused = 0;
+	}
+}
+
 static const char *rk_vpu_dec_list[] = {
 	"rockchip-vpu-vdec",	
 	"rockchip-vpu-dec",
@@ -519,15 +1670,20 @@ static const char *rk_vpu_dec_list[] = {
 	"rockchip,rk3399-vdec-dec",
 };
 
-struct rk_v4l2_object *rk_v4l2_dec_create(char *vpu_path)
+struct rk_v4l2_object *rk_v4l2_dec_create(const char *vpu_path)
 {
 	struct rk_v4l2_object *ctx;
 
-	ctx = malloc(sizeof(struct rk_v4l2_object));
+	ctx = calloc(1, sizeof(struct rk_v4l2_object));
 	if (NULL == ctx)
 		return NULL;
 
 	ctx->video_fd = -1;
+	ctx->input_memory = V4L2_MEMORY_MMAP;
+	ctx->output_memory = V4L2_MEMORY_MMAP;
+	rk_v4l2_queue_init(&ctx->input_queue, NULL, 0);
+	rk_v4l2_queue_init(&ctx->output_queue, NULL, 0);
+	rk_v4l2_request_pool_init(&ctx->requests, ctx->requests.size);
 
 	if (NULL != vpu_path)
 	{
@@ -568,15 +1724,20 @@ static const char *rk_vpu_enc_list[] = {
 	"rk3288-vpu-enc",
 };
 
-struct rk_v4l2_object *rk_v4l2_enc_create(char *vpu_path)
+struct rk_v4l2_object *rk_v4l2_enc_create(const char *vpu_path)
 {
 	struct rk_v4l2_object *ctx;
 
-	ctx = malloc(sizeof(struct rk_v4l2_object));
+	ctx = calloc(1, sizeof(struct rk_v4l2_object));
 	if (NULL == ctx)
 		return NULL;
 
 	ctx->video_fd = -1;
+	ctx->input_memory = V4L2_MEMORY_MMAP;
+	ctx->output_memory = V4L2_MEMORY_MMAP;
+	rk_v4l2_queue_init(&ctx->input_queue, NULL, 0);
+	rk_v4l2_queue_init(&ctx->output_queue, NULL, 0);
+	rk_v4l2_request_pool_init(&ctx->requests, ctx->requests.size);
 
 	if (NULL != vpu_path)
 	{
@@ -617,44 +1778,34 @@ void rk_v4l2_destroy(struct rk_v4l2_object *ctx)
 	 * v4l2 buffer */
 	/* FIXME the streamoff order is different between
 	 * encoder and decoder */
-	struct v4l2_format *format;
-
 	if (NULL == ctx)
 		return;
 
+	rk_v4l2_stop_completion(ctx);
+
 	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	if (ctx->input_streamon)
-		if (ioctl(ctx->video_fd, VIDIOC_STREAMOFF, &type) < 0)
+		if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMOFF, &type) < 0)
 			rk_info_msg("Streamoff failed on input");
 	ctx->input_streamon = false;
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	if (ctx->output_streamon)
-		if (ioctl(ctx->video_fd, VIDIOC_STREAMOFF, &type) < 0)
+		if (rk_v4l2_ioctl(ctx->video_fd, VIDIOC_STREAMOFF, &type) < 0)
 			rk_info_msg("Streamoff failed on output");
 	ctx->output_streamon = false;
 
-	format = &ctx->input_format;
-	for (uint32_t i = 0; i < ctx->num_input_buffers; i++) {
-		for (uint32_t j = 0; j < format->fmt.pix_mp.num_planes; j++)
-			if (NULL != ctx->input_buffer[i].plane[j].data)
-				munmap(ctx->input_buffer[i].plane[j].data,
-					ctx->input_buffer[i].plane[j].length);
-	}
+	rk_v4l2_queue_dump("input", &ctx->input_queue);
+	rk_v4l2_queue_dump("output", &ctx->output_queue);
+	rk_v4l2_request_pool_dump(&ctx->requests);
 
-	format = &ctx->output_format;
-	for (uint32_t i = 0; i < ctx->num_output_buffers; i++) {
-		for (uint32_t j = 0; j < format->fmt.pix_mp.num_planes; j++)
-			if (NULL != ctx->output_buffer[i].plane[j].data)
-				munmap(ctx->output_buffer[i].plane[j].data,
-					ctx->output_buffer[i].plane[j].length);
-	}
+	rk_v4l2_input_unmap(ctx);
+	rk_v4l2_output_unmap(ctx);
 
-	if (NULL != ctx->input_buffer)
-		free(ctx->input_buffer);
-	if (NULL != ctx->output_buffer)
-		free(ctx->output_buffer);
+	if (ctx->load)
+		rk_v4l2_device_release(ctx->load, ctx->load_pixels);
+	ctx->load = NULL;
 
-	close(ctx->video_fd);
+	rk_v4l2_backend->close(ctx->video_fd);
 	ctx->video_fd = 0;
 }
@@ -1,5 +1,7 @@
 #ifndef _V4L2_UTILS_H_
 #define _V4L2_UTILS_H_
+#include <pthread.h>
+#include <poll.h>
 #include <linux/videodev2.h>
 #include "common.h"
 #include "v4l2_memory.h"
@@ -9,6 +11,22 @@
 #define NUM_DEC_INPUT_PLANES  1
 #define NUM_DEC_OUTPUT_PLANES 1
 
+/* 
+ * The device behind the video fds, the kernel unless the mock VPU is
+ * chosen. All the ioctls on a video fd go through it.
+ */
+struct rk_v4l2_backend {
+	const char *name;
+	/* The nodes to probe, NULL to walk the video4linux class */
+	const char *const *devices;
+	/* Whether the fds could be waited on by epoll */
+	bool pollable;
+	int32_t (*open) (const char *path, int32_t flags);
+	int32_t (*close) (int32_t fd);
+	int32_t (*ioctl) (int32_t fd, unsigned long request, void *arg);
+	int32_t (*poll) (struct pollfd *fds, nfds_t nfds, int32_t timeout);
+};
+
 struct rk_v4l2_ops {
 	int32_t(*input_alloc) (void *, uint32_t);
 	int32_t(*output_alloc) (void *, uint32_t);
@@ -24,6 +42,100 @@ struct rk_v4l2_ops {
 		(void *, struct rk_v4l2_buffer **);
 };
 
+/* 
+ * The buffers of a V4L2 queue, the free ones are kept in a stack
+ * so taking or putting back one doesn't walk over all of them.
+ */
+struct rk_v4l2_queue {
+	struct rk_v4l2_buffer *buffers;
+	int32_t num_buffers;
+	int32_t free_list[VIDEO_MAX_FRAME];
+	/* Where a buffer is in the free list, -1 if it is not free */
+	int32_t free_slot[VIDEO_MAX_FRAME];
+	int32_t num_free;
+
+	/* Occupancy statistics */
+	int32_t num_enqueued;
+	int32_t max_enqueued;
+	uint32_t num_acquired;
+	uint32_t num_waits;
+	uint32_t num_timeouts;
+
+	/* Dequeued by the completion thread, not collected yet */
+	int32_t done_list[VIDEO_MAX_FRAME];
+	int32_t done_head;
+	int32_t num_done;
+};
+
+/* 
+ * A thread which dequeues the buffers the driver has finished, the
+ * callers then collect them from the queues without any ioctl and
+ * sleep on cond rather than in DQBUF. The lock protects the queues.
+ */
+struct rk_v4l2_completion {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int32_t epoll_fd;
+	/* Wakes the thread up to quit */
+	int32_t event_fd;
+	bool quit;
+	uint32_t num_wakeups;
+};
+
+#define RK_V4L2_MAX_REQUESTS VIDEO_MAX_FRAME
+
+#define RK_V4L2_MAX_DEVICES	8
+#define RK_V4L2_MAX_FORMATS	8
+
+/* 
+ * How busy a VPU node is, shared by all the contexts opened on it,
+ * so it is only updated with atomic operations.
+ */
+struct rk_v4l2_device_load {
+	int32_t num_contexts;
+	/* The picture sizes of the contexts, in pixels */
+	int64_t num_pixels;
+	/* The buffers of all the contexts in its queues */
+	int32_t num_enqueued;
+};
+
+/* What a M2M node of the VPU could do, probed once at driver init */
+struct rk_v4l2_device_info {
+	char path[32];
+	char card[32];
+	bool is_encoder;
+	/* The OUTPUT formats of a decoder, the CAPTURE ones of an encoder */
+	uint32_t coded_formats[RK_V4L2_MAX_FORMATS];
+	uint32_t num_coded_formats;
+	uint32_t raw_formats[RK_V4L2_MAX_FORMATS];
+	uint32_t num_raw_formats;
+	/* 0 if the driver doesn't enumerate the frame sizes */
+	uint32_t max_width;
+	uint32_t max_height;
+	/* The requests a codec control could keep, 0 if no request API */
+	uint32_t max_reqs;
+	/* The stateless controls the parser of the codec needs are there */
+	bool has_codec_controls;
+	struct rk_v4l2_device_load load;
+};
+
+/* 
+ * The IDs of the V4L2 request API of this kernel, a frame owns one
+ * from setting its controls until its bitstream buffer is dequeued,
+ * so the frames in flight never share their controls. 0 is no request.
+ */
+struct rk_v4l2_request_pool {
+	uint16_t free_list[RK_V4L2_MAX_REQUESTS];
+	int32_t num_free;
+	/* The IDs 1 to size are handed out, no more than the node keeps */
+	int32_t size;
+
+	/* Occupancy statistics */
+	uint32_t num_allocated;
+	int32_t max_in_flight;
+};
+
 struct rk_v4l2_object {
 	int32_t video_fd;
 
@@ -44,15 +156,98 @@ struct rk_v4l2_object {
 
 	struct v4l2_format input_format;
 	struct v4l2_format output_format;
-	int32_t has_free_input_buffers;
-	int32_t has_free_output_buffers;
+	struct rk_v4l2_queue input_queue;
+	struct rk_v4l2_queue output_queue;
+	/* Size of a bitstream buffer, MAX_CODEC_BUFFER if it is 0 */
+	uint32_t bitstream_size;
+	/* Format of the raw pictures, V4L2_PIX_FMT_NV12 if it is 0 */
+	uint32_t raw_format;
+	/* 
+	 * V4L2_MEMORY_DMABUF if the buffers of a queue are imported,
+	 * the dma_fd of a buffer is set by the user before it is queued.
+	 */
+	uint32_t input_memory;
+	uint32_t output_memory;
+	struct rk_v4l2_request_pool requests;
+	/* NULL if the callers dequeue by themselves */
+	struct rk_v4l2_completion *completion;
+	/* The load of the node it is counted in, NULL if none */
+	struct rk_v4l2_device_load *load;
+	int64_t load_pixels;
 };
+/* Lay the raw picture in the buffer out as the format of the queue */
+void rk_v4l2_buffer_set_layout(struct rk_v4l2_buffer *buffer,
+		const struct v4l2_format *format);
+
+/* Whether the VPU could use the memory of buffer in the format as it is */
+bool rk_v4l2_buffer_fits_format(const struct rk_v4l2_buffer *buffer,
+		const struct v4l2_format *format);
+
+/* An ioctl on a video fd, S_EXT_CTRLS of the codecs included */
+int32_t rk_v4l2_ioctl(int32_t fd, unsigned long request, void *arg);
+/* A free buffer which is still left in the pool */
 struct rk_v4l2_buffer *rk_v4l2_get_input_buffer(struct rk_v4l2_object *ctx);
 struct rk_v4l2_buffer *rk_v4l2_get_output_buffer(struct rk_v4l2_object *ctx);
+/* 
+ * Take a free buffer to be filled, wait timeout_ms at most for the
+ * driver to give back one if there is none. 
+ */
+struct rk_v4l2_buffer *rk_v4l2_acquire_input_buffer
+(struct rk_v4l2_object *ctx, int32_t timeout_ms);
+void rk_v4l2_put_input_buffer(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_buffer *buffer);
+/* 
+ * Give the buffer a request of its own for the controls of its frame,
+ * it goes back to the pool when the buffer does. Return 0 if all the
+ * requests are in flight.
+ */
+uint16_t rk_v4l2_request_alloc(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_buffer *buffer);
+/* Whether a CAPTURE buffer could be dequeued within timeout_ms */
+bool rk_v4l2_wait_output_buffer(struct rk_v4l2_object *ctx, int32_t timeout_ms);
 
+/* Dequeue the finished buffers in a thread from now on */
+bool rk_v4l2_start_completion(struct rk_v4l2_object *ctx);
+void rk_v4l2_stop_completion(struct rk_v4l2_object *ctx);
+/* Enumerate the M2M codec nodes, return how many are found */
+int32_t rk_v4l2_probe_devices(struct rk_v4l2_device_info *devices,
+		int32_t max_devices);
+bool rk_v4l2_device_has_format(const struct rk_v4l2_device_info *device,
+		uint32_t coded_format);
+/* The raw format the node would work in, NV12 is preferred to NV12M */
+uint32_t rk_v4l2_pick_raw_format(const struct rk_v4l2_device_info *device);
+/* The first node which could do the codec, NULL if none */
+const struct rk_v4l2_device_info *
+rk_v4l2_find_device(const struct rk_v4l2_device_info *devices,
+		int32_t num_devices, bool is_encoder, uint32_t coded_format);
+/* 
+ * The least busy node which could do the codec: the fewest pixels
+ * of the open contexts, then the fewest buffers in its queues, then
+ * the fewest contexts. -1 if none.
+ */
+int32_t rk_v4l2_select_device(const struct rk_v4l2_device_info *devices,
+		int32_t num_devices, bool is_encoder, uint32_t coded_format);
+void rk_v4l2_device_reserve(struct rk_v4l2_device_load *load,
+		int64_t pixels);
+void rk_v4l2_device_release(struct rk_v4l2_device_load *load,
+		int64_t pixels);
+/* Count the object in the load reserved for it until it is destroyed */
+void rk_v4l2_set_device_load(struct rk_v4l2_object *ctx,
+		struct rk_v4l2_device_load *load, int64_t pixels);
+void rk_v4l2_set_max_requests(struct rk_v4l2_object *ctx, uint32_t max_reqs);
 bool rk_v4l2_streamon_all(struct rk_v4l2_object *ctx);
-struct rk_v4l2_object *rk_v4l2_dec_create(char *vpu_path);
-struct rk_v4l2_object *rk_v4l2_enc_create(char *vpu_path);
+int32_t rk_v4l2_dec_resize_input(struct rk_v4l2_object *ctx, uint32_t size);
+int32_t rk_v4l2_dec_resize_output(struct rk_v4l2_object *ctx, uint32_t count);
+void rk_v4l2_set_input_memory(struct rk_v4l2_object *ctx, uint32_t memory);
+void rk_v4l2_set_output_memory(struct rk_v4l2_object *ctx, uint32_t memory);
+/* 
+ * Let a buffer of an imported queue use the dma-bufs of src, which
+ * could come from the DRM, a DMA heap or the other V4L2 device.
+ */
+void rk_v4l2_buffer_attach(struct rk_v4l2_buffer *buffer,
+		const struct rk_v4l2_buffer *src);
+struct rk_v4l2_object *rk_v4l2_dec_create(const char *vpu_path);
+struct rk_v4l2_object *rk_v4l2_enc_create(const char *vpu_path);
 void rk_v4l2_destroy(struct rk_v4l2_object *ctx);
 
 int32_t rk_v4l2_buffer_total_bytesused(struct rk_v4l2_buffer *buffer);